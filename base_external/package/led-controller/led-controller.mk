@@ -4,5 +4,14 @@ LED_CONTROLLER_VERSION = '0.1'
 LED_CONTROLLER_SITE = $(TOPDIR)/../led-controller-driver
 LED_CONTROLLER_SITE_METHOD = local
 
+# the module is built by kernel-module, this is the userspace test program
+define LED_CONTROLLER_BUILD_CMDS
+	$(MAKE) $(TARGET_CONFIGURE_OPTS) -C $(@D)/test clean all
+endef
+
+define LED_CONTROLLER_INSTALL_TARGET_CMDS
+	$(INSTALL) -m 0755 $(@D)/test/ledcontroller-ioctl-test $(TARGET_DIR)/usr/bin
+endef
+
 $(eval $(kernel-module))
 $(eval $(generic-package))
@@ -0,0 +1,20 @@
+#!/bin/sh
+#
+# test the ioctls and the events, from a program (append, edit, playback
+# controls, event reads)
+
+set -ex
+
+moddir=/sys/module/ledcontroller
+
+/etc/ledcontroller-load.sh led_count=2
+
+# states are only written with all the pins set (as in led-setup.sh)
+echo 67 > $moddir/leds/0/pin
+echo 68 > $moddir/leds/1/pin
+
+ledcontroller-ioctl-test /dev/ledc
+
+/etc/ledcontroller-unload.sh
+
+echo "All tests passed!"
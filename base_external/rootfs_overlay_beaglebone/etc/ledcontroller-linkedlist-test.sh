@@ -26,6 +26,16 @@ test $(cat $dev | wc -l) -eq 0
 /etc/ledcontroller-unload.sh
 /etc/ledcontroller-load.sh led_count=2
 
+# the output path is reported
+grep -qx -e hrtimer -e kthread $moddir/states/output_path
+
+# commits switch at the end of a frame by default, can be changed
+test "$(cat $moddir/states/commit)" = "frame"
+echo loop > $moddir/states/commit
+test "$(cat $moddir/states/commit)" = "loop"
+! echo sometime > $moddir/states/commit
+echo frame > $moddir/states/commit
+
 # test single line
 echo 1,0,10 > $dev
 # append
@@ -41,6 +51,104 @@ echo 1,0,2 >> $dev
 echo 1,1,5 >> $dev
 test $(cat $dev | wc -l) -eq 3
 
+# test time units (read back with the biggest exact unit, not as written)
+echo 1,0,250ms > $dev
+echo 0,1,1500us >> $dev
+echo 1,1,2000ms >> $dev
+test "$(cat $dev)" = "$(printf '1,0,250ms\n0,1,1500us\n1,1,2\n')"
+! echo "1,0,0us" > $dev
+! echo "1,0,5ns" > $dev
+# at most U32_MAX microseconds
+echo "1,0,4294s" > $dev
+! echo "1,0,4295s" > $dev
+! echo "1,0,4294968ms" > $dev
+
+# read back normalized: values as 0 or 1, times in the biggest exact unit
+echo 5,-1,1000ms > $dev
+test "$(cat $dev)" = "1,1,1"
+
+# identical lines are stored once, but read back one by one
+printf '1,0,100ms\n1,0,100ms\n1,0,100ms\n1,0,50ms\n' > $dev
+echo 1,0,50ms >> $dev
+test "$(cat $dev)" = "$(printf '1,0,100ms\n1,0,100ms\n1,0,100ms\n1,0,50ms\n1,0,50ms\n')"
+
+# per-led timelines, read back a track at a time
+echo @0:1,300ms > $dev
+echo @1:1,700ms >> $dev
+echo @0:0,300ms >> $dev
+test "$(cat $dev)" = "$(printf '@0:1,300ms\n@0:0,300ms\n@1:1,700ms\n')"
+# a led is in one track only, frames can't be mixed in
+! echo @0-1:1,1,1 >> $dev
+! echo 1,1,1 >> $dev
+! echo @2:1,1 >> $dev
+
+# saved states, played again without uploading them
+echo 1,0,100ms > $dev
+echo idle > $moddir/states/save
+echo 0,1,100ms > $dev
+echo busy > $moddir/states/save
+test "$(cat $moddir/states/library)" = "$(printf 'idle\nbusy\n')"
+echo idle > $moddir/states/play
+test "$(cat $moddir/states/play)" = "idle"
+test "$(cat $dev)" = "1,0,100ms"
+# they don't change: appends go to a copy, played instead
+echo 1,1,1 >> $dev
+test "$(cat $dev)" = "$(printf '1,0,100ms\n1,1,1\n')"
+test -z "$(cat $moddir/states/play)"
+echo idle > $moddir/states/play
+test "$(cat $dev)" = "1,0,100ms"
+! echo nothing > $moddir/states/play
+echo idle > $moddir/states/delete
+echo busy > $moddir/states/delete
+test -z "$(cat $moddir/states/library)"
+# and once they're not saved anymore, appended to as usual
+echo 0,0,1 >> $dev
+test $(cat $dev | wc -l) -eq 2
+
+# playback controls: pause (and seek while paused), rate, and loops
+echo 1,0,100ms > $dev
+echo 0,1,100ms >> $dev
+echo 1 > $moddir/states/paused
+test "$(cat $moddir/states/paused)" = "1"
+echo 1 > $moddir/states/seek
+! echo 2 > $moddir/states/seek
+echo 0 > $moddir/states/paused
+echo 200 > $moddir/states/rate
+test "$(cat $moddir/states/rate)" = "200"
+! echo 0 > $moddir/states/rate
+echo 100 > $moddir/states/rate
+echo 3 > $moddir/states/loops
+test "$(cat $moddir/states/loops)" = "3"
+echo 0 > $moddir/states/loops
+# seek lines are as the states read back, the sub-patterns first, and only in the frames
+printf 'def blink\n1,1,100ms\nenddef\n1,0,100ms\n0,1,100ms\n' > $dev
+! echo 0 > $moddir/states/seek
+! echo 1 > $moddir/states/seek
+! echo 2 > $moddir/states/seek
+echo 3 > $moddir/states/seek
+echo 4 > $moddir/states/seek
+! echo 5 > $moddir/states/seek
+echo @0:1,100ms > $dev
+! echo 0 > $moddir/states/seek
+
+# repeated blocks and sub-patterns, kept as written
+printf 'def blink\n1,1,100ms\n0,0,100ms\nenddef\nrepeat 3\ncall blink\nend\n1,0,1\n' > $dev
+test "$(cat $dev)" = "$(printf 'def blink\n1,1,100ms\n0,0,100ms\nenddef\nrepeat 3\ncall blink\nend\n1,0,1\n')"
+# blocks are balanced, and not empty, sub-patterns are defined before they're used
+! printf 'end\n' > $dev
+! printf 'repeat 2\nend\n' > $dev
+! printf 'call nothing\n' > $dev
+# an open block is its writer's, the others can't append into it
+> $dev
+exec 3>>$dev
+echo 'repeat 2' >&3
+echo 1,0,100ms >&3
+! echo 0,1,100ms >> $dev
+echo end >&3
+echo 0,1,100ms >> $dev
+exec 3>&-
+test "$(cat $dev)" = "$(printf 'repeat 2\n1,0,100ms\nend\n0,1,100ms\n')"
+
 # test wrong inputs
 # not CSV
 ! echo "hello" > $dev
@@ -57,6 +165,31 @@ test $(cat $dev | wc -l) -eq $test_data_size
 cat /etc/test_data/linklist_0 >> $dev
 test $(cat $dev | wc -l) -eq $(echo $test_data_size + $test_data_size | bc -q)
 
+# concurrent appenders, each on its own file
+> $dev
+cat /etc/test_data/linklist_0 >> $dev &
+cat /etc/test_data/linklist_0 >> $dev &
+wait
+test $(cat $dev | wc -l) -eq $(echo $test_data_size + $test_data_size | bc -q)
+
+# memory is accounted, and limited: an upload over the budget isn't committed
+test $(cat $moddir/memory/usage) -gt 0
+test $(cat $moddir/memory/peak) -ge $(cat $moddir/memory/usage)
+budget=$(cat $moddir/parameters/mem_budget)
+# not even for the upload to start
+echo 1 > $moddir/parameters/mem_budget
+! cat /etc/test_data/linklist_0 > $dev
+test $(cat $dev | wc -l) -eq $(echo $test_data_size + $test_data_size | bc -q)
+# enough for it to start, not for all of it (different states, so they aren't runs)
+echo $(( $(cat $moddir/memory/usage) + 16384 )) > $moddir/parameters/mem_budget
+seq 1 5000 | sed 's/.*/1,0,&us/' > /tmp/ledc-over-budget
+exec 3>$dev
+! cat /tmp/ledc-over-budget >&3
+exec 3>&-
+rm /tmp/ledc-over-budget
+test $(cat $dev | wc -l) -eq $(echo $test_data_size + $test_data_size | bc -q)
+echo $budget > $moddir/parameters/mem_budget
+
 # test changing led parameters when LL is set
 ! echo 1 > $moddir/parameters/led_count
 
@@ -71,6 +204,54 @@ echo 20 > $moddir/leds/0/pin
 # reset, just in case
 echo '-1' > $moddir/leds/0/pin
 
+# channels: each plays its own states, on its own leds (and their pins)
+/etc/ledcontroller-unload.sh
+/etc/ledcontroller-load.sh channels=2 led_count=2
+test -c /dev/ledc0 -a -c /dev/ledc1
+test "$(cat $moddir/channels/0/leds)" = "0-31"
+test -z "$(cat $moddir/channels/1/leds)"
+# a led only belongs to one channel
+! echo 1 > $moddir/channels/1/leds
+echo 0 > $moddir/channels/0/leds
+echo 1 > $moddir/channels/1/leds
+echo 67 > $moddir/leds/0/pin
+echo 68 > $moddir/leds/1/pin
+# a value for each of the channel's leds
+! echo 1,1,100ms > /dev/ledc0
+echo 1,100ms > /dev/ledc0
+echo 0,100ms > /dev/ledc1
+echo 0,100ms >> /dev/ledc1
+test "$(cat /dev/ledc0)" = "1,100ms"
+test "$(cat /dev/ledc1)" = "$(printf '0,100ms\n0,100ms\n')"
+# the pins, as set (committed states start at the end of a frame)
+mountpoint -q /sys/kernel/debug || mount -t debugfs none /sys/kernel/debug
+pin_is() {
+	sleep 0.3
+	grep -qE "gpio-$1 .* out $2" /sys/kernel/debug/gpio
+}
+pin_is 67 hi
+pin_is 68 lo
+# one changes, the other plays on
+echo 1,100ms > /dev/ledc1
+pin_is 68 hi
+pin_is 67 hi
+# one pauses, the other doesn't
+echo 1 > $moddir/channels/1/paused
+test "$(cat $moddir/channels/0/paused)" = "0"
+echo 0,100ms > /dev/ledc0
+pin_is 67 lo
+pin_is 68 hi
+echo 0 > $moddir/channels/1/paused
+# one stops, its leds go off, the other's stay
+> /dev/ledc1
+pin_is 68 lo
+test "$(cat /dev/ledc0)" = "0,100ms"
+# not while it has states
+! echo 0,2 > $moddir/channels/0/leds
+> /dev/ledc0
+echo '-1' > $moddir/leds/0/pin
+echo '-1' > $moddir/leds/1/pin
+
 # and cleanup
 
 /etc/ledcontroller-unload.sh
@@ -14,3 +14,13 @@ rm -f /dev/${device}
 mknod /dev/${device} c $major 0
 chgrp $group /dev/${device}
 chmod $mode /dev/${device}
+
+# and one per channel (the first one is also the above)
+channels=$(cat /sys/module/${module}/parameters/channels)
+for minor in $(seq 0 $((channels - 1)))
+do
+	rm -f /dev/${device}${minor}
+	mknod /dev/${device}${minor} c $major $minor
+	chgrp $group /dev/${device}${minor}
+	chmod $mode /dev/${device}${minor}
+done
@@ -6,4 +6,4 @@ set -e
 
 rmmod $module
 
-rm -f /dev/${device}
+rm -f /dev/${device} /dev/${device}[0-9]*
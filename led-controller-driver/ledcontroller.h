@@ -0,0 +1,111 @@
+/*
+	Interface with userspace for /dev/ledc
+
+	The text lines read back normalized, as the states are kept: a led
+	value is `0` or `1` (anything but 0 is on), and the time is in the
+	biggest unit that keeps it exact, so `5,1000ms` reads back as `1,1`.
+*/
+#ifndef _LED_CONTROLLER_H_
+#define _LED_CONTROLLER_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+	A single state, in binary:
+	- `values` -> bit `i` is led `i`, no bits past `led_count`
+	- `time`   -> how long to hold it, in microseconds (> 0), so at most
+	              a bit over 71 minutes: longer ones take several states
+*/
+struct ledc_state {
+	__u32 values;
+	__u32 time;
+};
+
+/* append `count` states, read from the `states` array */
+struct ledc_append {
+	__u64 states;	/* (struct ledc_state *) */
+	__u32 count;
+	__u32 __reserved;
+};
+
+#define LEDC_IOC_MAGIC 'L'
+
+/*
+	Bulk append, no text parsing involved.
+
+	Returns the number of states appended; it stops at the first
+	invalid state (which fails with -EINVAL if it's the first one).
+*/
+#define LEDC_IOC_APPEND _IOW(LEDC_IOC_MAGIC, 1, struct ledc_append)
+
+/*
+	Edit a track, in place: the `remove` states from `index` on (as they
+	read back, in that track) are replaced with the `count` from `states`
+	- replace       -> `remove` == `count`
+	- insert before -> `remove` == 0
+	- delete        -> `count` == 0
+	Only states are edited, ops (`repeat`, `call`, ...) can't be.
+*/
+struct ledc_edit {
+	__u32 index;
+	__u32 remove;
+	__u64 states;	/* (struct ledc_state *) */
+	__u32 count;
+	__u32 leds;	/* the track, its leds as in `@first-last:` (0 for frames) */
+};
+
+/* Returns 0, or fails with nothing changed (-EINVAL if there's no such track) */
+#define LEDC_IOC_EDIT _IOW(LEDC_IOC_MAGIC, 2, struct ledc_edit)
+
+/*
+	Playback controls, for the channel (any open file), as in sysfs:
+	- pause/resume -> hold the current states, and the leds, then go on
+	                  from there (new states wait for it too)
+	- seek         -> go to a line of the frames (there's none with
+	                  tracks of their own leds, `@first-last:`), only
+	                  what plays from there is set, and told. Lines are
+	                  counted as the states read back: the sub-patterns
+	                  (`def` ... `enddef`) come first, and their lines count
+	- rate         -> in percent of real time, 1 to 10000 (100 by default),
+	                  from the next state on
+	- loops        -> how many times the first track plays before the
+	                  channel stops, 0 for ever (the default); setting it
+	                  starts a channel that stopped over again
+*/
+#define LEDC_IOC_PAUSE  _IO(LEDC_IOC_MAGIC, 3)
+#define LEDC_IOC_RESUME _IO(LEDC_IOC_MAGIC, 4)
+#define LEDC_IOC_SEEK   _IOW(LEDC_IOC_MAGIC, 5, __u32)
+#define LEDC_IOC_RATE   _IOW(LEDC_IOC_MAGIC, 6, __u32)
+#define LEDC_IOC_LOOPS  _IOW(LEDC_IOC_MAGIC, 7, __u32)
+
+/*
+	What the channel's runner went through, as it happens
+	- time   -> when, in nanoseconds (CLOCK_MONOTONIC), as it was due
+	- reason -> LEDC_EVENT_*
+	- track, index, values -> for the ones about a track
+*/
+struct ledc_event {
+	__u64 time;
+	__u32 reason;
+	__u32 track;
+	__u32 index;
+	__u32 values;
+};
+
+#define LEDC_EVENT_STATE  1	/* the track went on to state `index` (of the states it's in: the track's, or a sub-pattern's), with `values` */
+#define LEDC_EVENT_LOOP   2	/* the track went back to its start, everything appended to it before was played */
+#define LEDC_EVENT_START  3	/* newly committed states started (or the same ones again) */
+#define LEDC_EVENT_STOP   4	/* nothing left to play, the leds are off */
+#define LEDC_EVENT_PAUSE  5
+#define LEDC_EVENT_RESUME 6
+#define LEDC_EVENT_LOST   7	/* the reader fell behind, `index` events were dropped */
+
+/*
+	Read events instead of the states, from now on: whole `struct
+	ledc_event` records, as many as there are, waiting for one unless
+	O_NONBLOCK. poll() has the file readable when there are events.
+*/
+#define LEDC_IOC_EVENTS _IO(LEDC_IOC_MAGIC, 8)
+
+#endif
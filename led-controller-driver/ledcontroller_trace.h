@@ -0,0 +1,81 @@
+/*
+	Tracepoints, for the runner: under events/ledcontroller in tracefs
+*/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ledcontroller
+
+#if !defined(_LED_CONTROLLER_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _LED_CONTROLLER_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/* the timer went off, `late` after it was due, and steps the channels itself (`direct`) or not */
+TRACE_EVENT(ledc_timer_fire,
+	TP_PROTO(s64 late, bool direct),
+	TP_ARGS(late, direct),
+	TP_STRUCT__entry(
+		__field(s64, late)
+		__field(bool, direct)
+	),
+	TP_fast_assign(
+		__entry->late = late;
+		__entry->direct = direct;
+	),
+	TP_printk("late=%lldns direct=%d", __entry->late, __entry->direct)
+);
+
+/* the runner thread woke up on `signals`, `latency` after the timer was due (0 if it wasn't for it) */
+TRACE_EVENT(ledc_runner_wake,
+	TP_PROTO(unsigned long signals, s64 latency),
+	TP_ARGS(signals, latency),
+	TP_STRUCT__entry(
+		__field(unsigned long, signals)
+		__field(s64, latency)
+	),
+	TP_fast_assign(
+		__entry->signals = signals;
+		__entry->latency = latency;
+	),
+	TP_printk("signals=%lx latency=%lldns", __entry->signals, __entry->latency)
+);
+
+/* the `changed` leds were set to `values`, it took `duration` */
+TRACE_EVENT(ledc_gpio_apply,
+	TP_PROTO(u32 values, u32 changed, s64 duration),
+	TP_ARGS(values, changed, duration),
+	TP_STRUCT__entry(
+		__field(u32, values)
+		__field(u32, changed)
+		__field(s64, duration)
+	),
+	TP_fast_assign(
+		__entry->values = values;
+		__entry->changed = changed;
+		__entry->duration = duration;
+	),
+	TP_printk("values=%08x changed=%08x duration=%lldns", __entry->values, __entry->changed, __entry->duration)
+);
+
+/* the runner picked up the states committed on `channel`, with `tracks` tracks */
+TRACE_EVENT(ledc_sequence_swap,
+	TP_PROTO(int channel, unsigned tracks),
+	TP_ARGS(channel, tracks),
+	TP_STRUCT__entry(
+		__field(int, channel)
+		__field(unsigned, tracks)
+	),
+	TP_fast_assign(
+		__entry->channel = channel;
+		__entry->tracks = tracks;
+	),
+	TP_printk("channel=%d tracks=%u", __entry->channel, __entry->tracks)
+);
+
+#endif /* _LED_CONTROLLER_TRACE_H_ */
+
+/* it's not in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ledcontroller_trace
+#include <trace/define_trace.h>
@@ -6,452 +6,2831 @@
 #include <linux/kstrtox.h>
 #include <linux/slab.h>
 #include <linux/string.h>
+#include <linux/ctype.h>
 #include <linux/kobject.h>
 #include <linux/rwsem.h>
 #include <linux/gpio/consumer.h>
 #include <linux/gpio.h>
+#include <linux/bitmap.h>
 #include <linux/fcntl.h>
+#include <linux/uaccess.h>
+#include <linux/seq_file.h>
+#include <linux/rcupdate.h>
+#include <linux/srcu.h>
+#include <linux/min_heap.h>
 // for hrtimer
 #include <linux/hrtimer.h>
 #include <linux/ktime.h>
+#include <linux/math64.h>
 // for gpio outputs
 #include <linux/wait.h>
+#include <linux/poll.h>
 #include <linux/kthread.h>
+#include <linux/debugfs.h>
 
 #include "structs.h"
+#include "ledcontroller.h"
+
+#define CREATE_TRACE_POINTS
+#include "ledcontroller_trace.h"
 
 MODULE_AUTHOR("Tiago Teixeira");
 MODULE_LICENSE("Dual BSD/GPL");
 
 /*
-	Global stuff
-*/
+	Global stuff
+*/
+
+int lc_dev_major = 0;
+int lc_dev_minor = 0;
+
+/* one minor per channel */
+static int lc_channels = 1;
+module_param_named(channels, lc_channels, int, 0444);
+
+struct lc_states_dev lc_states_devs[LC_CHANNELS_MAX];
+
+/* shared by all the channels (it's the params) */
+extern struct leds leds;
+
+/*
+	Memory: the states are kept in chunks, from their own cache, and all
+	of the sequences' memory counts against a budget, so a runaway writer
+	gets -ENOSPC instead of taking the kernel's memory
+*/
+#define LC_CHUNK_BYTES (LC_CHUNK_STATES * sizeof(struct lc_state))
+
+/* in bytes, 0 for no limit */
+static unsigned long lc_mem_budget = 16 << 20;
+module_param_named(mem_budget, lc_mem_budget, ulong, 0644);
+
+static struct kmem_cache *lc_chunk_cache;
+static atomic_long_t lc_mem_usage = ATOMIC_LONG_INIT(0);
+static atomic_long_t lc_mem_peak = ATOMIC_LONG_INIT(0);
+
+static int _mem_charge(size_t size)
+{
+	long usage = atomic_long_add_return(size, &lc_mem_usage);
+	long peak = atomic_long_read(&lc_mem_peak);
+	unsigned long budget = READ_ONCE(lc_mem_budget);
+	if(budget && usage > budget)
+	{
+		atomic_long_sub(size, &lc_mem_usage);
+		return -ENOSPC;
+	}
+	while(usage > peak && !atomic_long_try_cmpxchg(&lc_mem_peak, &peak, usage))
+		;
+	return 0;
+}
+
+static void _mem_uncharge(size_t size)
+{
+	atomic_long_sub(size, &lc_mem_usage);
+}
+
+/*
+	States table
+*/
+
+/*
+	The table, for whoever may change it: writers are serialized by
+	the caller (semaphore, or a file's own staged states)
+*/
+static struct lc_chunks *_states_table(struct lc_states *states)
+{
+	return rcu_dereference_protected(states->table, 1);
+}
+
+/* the chunk state `index` is in: the last of the first `used` starting at or before it */
+static unsigned _chunks_find(struct lc_chunks *table, unsigned used, unsigned index)
+{
+	unsigned lo = 0, hi = used, mid;
+	while(hi - lo > 1)
+	{
+		mid = (lo + hi) / 2;
+		if(table->chunks[mid].start <= index)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static struct lc_state *_chunks_at(struct lc_chunks *table, unsigned used, unsigned index)
+{
+	struct lc_chunk *chunk = &table->chunks[_chunks_find(table, used, index)];
+	return &chunk->states[index - chunk->start];
+}
+
+static struct lc_state *_states_at(struct lc_states *states, unsigned index)
+{
+	struct lc_chunks *table = _states_table(states);
+	return _chunks_at(table, table->used, index);
+}
+
+/* add `lines` to the chunk of state `index` (for writers) */
+static void _states_lines(struct lc_states *states, unsigned index, int lines)
+{
+	struct lc_chunks *table = _states_table(states);
+	table->chunks[_chunks_find(table, table->used, index)].lines += lines;
+}
+
+/* the edits `src` went through, for `dst` that has the same states */
+static void _chunks_edits(struct lc_chunks *dst, struct lc_chunks *src)
+{
+	dst->edits = src->edits;
+	memcpy(dst->edit_log, src->edit_log, sizeof(dst->edit_log));
+}
+
+/* a copy of `table` (if any) with room for `len` chunks, charged to the budget */
+static struct lc_chunks *_chunks_alloc(struct lc_chunks *table, unsigned len)
+{
+	struct lc_chunks *copy;
+	int err;
+	if((err = _mem_charge(struct_size(copy, chunks, len))))
+		return ERR_PTR(err);
+	if(!(copy = kzalloc(struct_size(copy, chunks, len), GFP_KERNEL)))
+	{
+		_mem_uncharge(struct_size(copy, chunks, len));
+		return ERR_PTR(-ENOMEM);
+	}
+	copy->len = len;
+	if(table)
+	{
+		memcpy(copy->chunks, table->chunks, table->used*sizeof(struct lc_chunk));
+		copy->used = table->used;
+		copy->count = table->count;
+		_chunks_edits(copy, table);
+	}
+	return copy;
+}
+
+/*
+	Free `table`, and its chunks [first, last), all in one go: its entries
+	make room for the pointers to them, as it goes with them
+*/
+static void _chunks_free(struct lc_chunks *table, unsigned first, unsigned last)
+{
+	void **states = (void **)table->chunks;
+	unsigned i;
+	BUILD_BUG_ON(sizeof(struct lc_chunk) < sizeof(void *));
+	for(i=first;i<last;i++)
+		states[i-first] = table->chunks[i].states;
+	if(last > first)
+		kmem_cache_free_bulk(lc_chunk_cache, last - first, states);
+	_mem_uncharge((last - first) * LC_CHUNK_BYTES + struct_size(table, chunks, table->len));
+	kfree(table);
+}
+
+/* a table an edit replaced, once the runner is done with it */
+static void _chunks_drop_rcu(struct rcu_head *rcu)
+{
+	struct lc_chunks *table = container_of(rcu, struct lc_chunks, rcu);
+	_chunks_free(table, table->dropped_first, table->dropped_last);
+}
+
+/* a chunk, charged to the budget */
+static struct lc_state *_chunk_alloc(void)
+{
+	struct lc_state *states;
+	if(_mem_charge(LC_CHUNK_BYTES))
+		return ERR_PTR(-ENOSPC);
+	if(!(states = kmem_cache_alloc(lc_chunk_cache, GFP_KERNEL)))
+	{
+		_mem_uncharge(LC_CHUNK_BYTES);
+		return ERR_PTR(-ENOMEM);
+	}
+	return states;
+}
+
+static void _chunk_free(struct lc_state *states)
+{
+	kmem_cache_free(lc_chunk_cache, states);
+	_mem_uncharge(LC_CHUNK_BYTES);
+}
+
+/*
+	Get a slot for a new state at the end of the table,
+	it only counts once the caller commits it.
+	-ENOSPC if it's over the budget
+*/
+static struct lc_state *_states_reserve(struct lc_states *states)
+{
+	struct lc_chunks *table = _states_table(states), *grown;
+	struct lc_chunk *last = table && table->used ? &table->chunks[table->used-1] : NULL;
+	struct lc_state *chunk;
+	if(last && states->count - last->start < LC_CHUNK_STATES)
+		return &last->states[states->count - last->start];
+	if(!table || table->used == table->len)
+	{
+		// grow the chunk table, into a copy
+		if(IS_ERR(grown = _chunks_alloc(table, table ? table->len * 2 : 1)))
+			return ERR_CAST(grown);
+		// the runner may still be reading the old one
+		rcu_assign_pointer(states->table, grown);
+		if(table)
+		{
+			_mem_uncharge(struct_size(table, chunks, table->len));
+			kfree_rcu(table, rcu);
+		}
+		table = grown;
+	}
+	if(IS_ERR(chunk = _chunk_alloc()))
+		return chunk;
+	// not reachable by the runner until `count` gets here
+	table->chunks[table->used] = (struct lc_chunk){ chunk, states->count, 0 };
+	smp_store_release(&table->used, table->used + 1);
+	return chunk;
+}
+
+/*
+	Same as `_states_reserve`, for bulk appends: `count` is set to the
+	number of free slots that follow, up to the end of the chunk
+*/
+static struct lc_state *_states_reserve_run(struct lc_states *states, unsigned *count)
+{
+	struct lc_state *state = _states_reserve(states);
+	struct lc_chunks *table = _states_table(states);
+	if(!IS_ERR(state))
+		*count = LC_CHUNK_STATES - (states->count - table->chunks[table->used-1].start);
+	return state;
+}
+
+/* make the `count` reserved slots count, they're visible to the runner after this */
+static void _states_commit(struct lc_states *states, unsigned count)
+{
+	states->count += count;
+	smp_store_release(&_states_table(states)->count, states->count);
+}
+
+/*
+	Copy out state `index`, for the runner, without locking.
+	False if there's no such state (anymore, if it was edited)
+*/
+static bool _states_get(struct lc_states *states, unsigned index, struct lc_state *state)
+{
+	struct lc_chunks *table;
+	bool found;
+	rcu_read_lock();
+	table = rcu_dereference(states->table);
+	// the chunks are published before the states in them
+	if((found = table && index < smp_load_acquire(&table->count)))
+		*state = *_chunks_at(table, smp_load_acquire(&table->used), index);
+	rcu_read_unlock();
+	return found;
+}
+
+/*
+	Move position `pos` in `states`, as of `*edits` edits of them, past
+	the edits since (for the runner): after the states an edit replaced
+	it moves with them, in them it goes to where they start, to the new
+	ones. Too far behind, it's left as is
+*/
+static unsigned _states_follow(struct lc_states *states, unsigned pos, unsigned *edits)
+{
+	struct lc_chunks *table;
+	struct lc_edit *edit;
+	rcu_read_lock();
+	table = rcu_dereference(states->table);
+	if(table && table->edits != *edits)
+	{
+		if(table->edits - *edits <= LC_EDITS_KEPT)
+		{
+			for(;*edits != table->edits;(*edits)++)
+			{
+				edit = &table->edit_log[*edits % LC_EDITS_KEPT];
+				if(pos > edit->first)
+					pos = pos >= edit->last ? pos + edit->delta : edit->first;
+			}
+		}
+		*edits = table->edits;
+	}
+	rcu_read_unlock();
+	return pos;
+}
+
+/* whether `state` is a run, of the one before */
+static bool _state_is_run(const struct lc_state *state)
+{
+	return !state->time && LC_OP(state->values) == LC_OP_RUN;
+}
+
+/* the lines `state` reads back as */
+static unsigned _state_lines(const struct lc_state *state)
+{
+	return _state_is_run(state) ? LC_OP_ARG(state->values) : 1;
+}
+
+/*
+	How many times state `index` repeats, after the first (for writers and
+	readers). A run is always in the same chunk as its state
+*/
+static unsigned _states_run(struct lc_states *states, unsigned index)
+{
+	struct lc_state *next;
+	if(index + 1 >= states->count)
+		return 0;
+	next = _states_at(states, index + 1);
+	return _state_is_run(next) ? LC_OP_ARG(next->values) : 0;
+}
+
+/*
+	The state line `line` (below the lines there are) is of, and how many
+	lines into its run (`rep`), for writers and readers: the chunk is found
+	by its lines, then the state in it
+*/
+static unsigned _states_line(struct lc_states *states, unsigned line, unsigned *rep)
+{
+	struct lc_chunks *table = _states_table(states);
+	unsigned c, index, run;
+	for(c=0;line >= table->chunks[c].lines;c++)
+		line -= table->chunks[c].lines;
+	index = table->chunks[c].start;
+	// runs are skipped as a whole
+	while(line > (run = _states_run(states, index)))
+	{
+		line -= run + 1;
+		index += run ? 2 : 1;
+	}
+	*rep = line;
+	return index;
+}
+
+/*
+	Pack the `count` states just written to the reserved slots of `track`
+	(for writers): a state identical to the one before becomes a run of it,
+	or makes the run it follows longer. Returns the number of slots left to
+	commit, in order, from the first.
+
+	A committed run is the only thing ever changed in place: the runner
+	sees its count before or after, and plays the states it had then
+*/
+static unsigned _track_pack(struct lc_track *track, struct lc_state *slots, unsigned count)
+{
+	struct lc_states *states = &track->states;
+	struct lc_chunks *table = _states_table(states);
+	// the slots are at the start of the last chunk, a run can't go there
+	bool chunk_start = states->count == table->chunks[table->used-1].start;
+	struct lc_state *last, *prev;
+	unsigned i, packed = 0;
+	for(i=0;i<count;i++)
+	{
+		track->lines++;
+		last = packed ? &slots[packed-1] : states->count ? _states_at(states, states->count-1) : NULL;
+		prev = last;
+		if(last && _state_is_run(last))
+		{
+			prev = packed > 1 ? &slots[packed-2]
+				: _states_at(states, states->count + packed - 2);
+		}
+		if(slots[i].time && prev && prev->time == slots[i].time && prev->values == slots[i].values)
+		{
+			if(last != prev && LC_OP_ARG(last->values) < LC_OP_ARG_MAX)
+			{
+				WRITE_ONCE(last->values, last->values + 1);
+				_states_lines(states, states->count + packed - 1, 1);
+				continue;
+			}
+			if(last == prev && (packed || !chunk_start))
+			{
+				slots[packed++] = (struct lc_state){ LC_OP_MAKE(LC_OP_RUN, 1), 0 };
+				table->chunks[table->used-1].lines++;
+				continue;
+			}
+			// the run is as long as it gets (or in another chunk), start another
+		}
+		slots[packed++] = slots[i];
+		table->chunks[table->used-1].lines++;
+	}
+	return packed;
+}
+
+/*
+	Replace states [first, last) with the `count` ones in `src` (for writers),
+	by rebuilding only the chunks they're in, into a new table: the runner
+	switches to it as a whole, the chunks it replaced are freed once the
+	runner is done with them, without waiting for it.
+
+	Runs in `src` are with their states, and so must be the states around them
+*/
+static int _states_splice(struct lc_states *states, unsigned first, unsigned last, const struct lc_state *src, unsigned count)
+{
+	struct lc_chunks *table = _states_table(states), *spliced;
+	struct lc_state *merged = NULL, *chunk;
+	struct lc_chunk *fresh = NULL;
+	unsigned ci = 0, cj = 0, start = 0, end = 0, prefix = 0, total, nc = 0, k, n, i;
+	unsigned used = table ? table->used : 0;
+	int err = 0, delta = count - (last - first);
+	if(used)
+	{
+		ci = _chunks_find(table, used, first);
+		cj = last > first ? _chunks_find(table, used, last - 1) : ci;
+		start = table->chunks[ci].start;
+		end = cj + 1 < used ? table->chunks[cj+1].start : states->count;
+		prefix = first - start;
+	}
+	// what's kept of the chunks, around the new states
+	total = prefix + count + (end - last);
+	if(!(merged = kvmalloc_array(total + 1, sizeof(struct lc_state), GFP_KERNEL))
+		|| !(fresh = kcalloc(total / (LC_CHUNK_STATES-1) + 1, sizeof(struct lc_chunk), GFP_KERNEL)))
+	{
+		err = -ENOMEM;
+		goto _out;
+	}
+	if(prefix)
+		memcpy(merged, table->chunks[ci].states, prefix*sizeof(struct lc_state));
+	memcpy(merged + prefix, src, count*sizeof(struct lc_state));
+	for(i=last;i<end;i++)
+		merged[prefix+count+i-last] = *_states_at(states, i);
+	// into new chunks
+	for(k=0;k<total;k+=n)
+	{
+		n = min(total - k, (unsigned)LC_CHUNK_STATES);
+		// a run stays with its state
+		if(k + n < total && _state_is_run(&merged[k+n]))
+			n--;
+		if(IS_ERR(chunk = _chunk_alloc()))
+		{
+			err = PTR_ERR(chunk);
+			goto _out;
+		}
+		memcpy(chunk, merged + k, n*sizeof(struct lc_state));
+		fresh[nc] = (struct lc_chunk){ chunk, start + k, 0 };
+		for(i=0;i<n;i++)
+			fresh[nc].lines += _state_lines(&chunk[i]);
+		nc++;
+	}
+	// and the table, with them in place of the ones they replace
+	n = used ? used - (cj - ci + 1) + nc : nc;
+	if(IS_ERR(spliced = _chunks_alloc(NULL, max(n, table ? table->len : 1))))
+	{
+		err = PTR_ERR(spliced);
+		goto _out;
+	}
+	if(used)
+		memcpy(spliced->chunks, table->chunks, ci*sizeof(struct lc_chunk));
+	memcpy(spliced->chunks + ci, fresh, nc*sizeof(struct lc_chunk));
+	for(i=cj+1;i<used;i++)
+	{
+		spliced->chunks[ci+nc+i-cj-1] = table->chunks[i];
+		spliced->chunks[ci+nc+i-cj-1].start += delta;
+	}
+	spliced->used = n;
+	spliced->count = states->count = states->count + delta;
+	// for the runner's cursors, in the states after it or in the ones replaced
+	if(table)
+		_chunks_edits(spliced, table);
+	spliced->edit_log[spliced->edits++ % LC_EDITS_KEPT] = (struct lc_edit){ first, last, delta };
+	rcu_assign_pointer(states->table, spliced);
+	nc = 0;
+	if(table)
+	{
+		table->dropped_first = ci;
+		table->dropped_last = min(cj + 1, used);
+		call_rcu(&table->rcu, _chunks_drop_rcu);
+	}
+_out:
+	// (the new chunks, if they're not in use)
+	for(i=0;i<nc;i++)
+		_chunk_free(fresh[i].states);
+	kfree(fresh);
+	kvfree(merged);
+	return err;
+}
+
+static void _states_free(struct lc_states *states)
+{
+	struct lc_chunks *table = _states_table(states);
+	if(table)
+		_chunks_free(table, 0, table->used);
+}
+
+/*
+	Sequences
+*/
+
+/* -ENOSPC if it's over the budget */
+static struct lc_sequence *_sequence_alloc(void)
+{
+	struct lc_sequence *seq;
+	if(_mem_charge(sizeof(struct lc_sequence)))
+		return ERR_PTR(-ENOSPC);
+	if(!(seq = kzalloc(sizeof(struct lc_sequence), GFP_KERNEL)))
+	{
+		_mem_uncharge(sizeof(struct lc_sequence));
+		return ERR_PTR(-ENOMEM);
+	}
+	seq->defining = -1;
+	refcount_set(&seq->refs, 1);
+	return seq;
+}
+
+static void _sequence_free(struct lc_sequence *seq)
+{
+	unsigned i;
+	if(!seq)
+		return;
+	for(i=0;i<seq->tracks_len;i++)
+		_states_free(&seq->tracks[i].states);
+	for(i=0;i<seq->subs_len;i++)
+		_states_free(&seq->subs[i].track.states);
+	kfree(seq);
+	_mem_uncharge(sizeof(struct lc_sequence));
+}
+
+/* a copy of `src`'s states into `dst` (for writers), with chunks of their own */
+static int _states_copy(struct lc_states *dst, struct lc_states *src)
+{
+	struct lc_chunks *table = _states_table(src), *copy;
+	struct lc_state *chunk;
+	unsigned i, end;
+	RCU_INIT_POINTER(dst->table, NULL);
+	dst->count = 0;
+	if(!table)
+		return 0;
+	if(IS_ERR(copy = _chunks_alloc(NULL, table->len)))
+		return PTR_ERR(copy);
+	// freed with `dst`, as far as it got
+	RCU_INIT_POINTER(dst->table, copy);
+	for(i=0;i<table->used;i++)
+	{
+		if(IS_ERR(chunk = _chunk_alloc()))
+			return PTR_ERR(chunk);
+		end = i + 1 < table->used ? table->chunks[i+1].start : src->count;
+		memcpy(chunk, table->chunks[i].states, (end - table->chunks[i].start)*sizeof(struct lc_state));
+		copy->chunks[i] = table->chunks[i];
+		copy->chunks[i].states = chunk;
+		copy->used = i + 1;
+	}
+	copy->count = dst->count = src->count;
+	// the runner goes on from where it was in them
+	_chunks_edits(copy, table);
+	return 0;
+}
+
+/*
+	A copy of `seq` (for writers), not saved: saved states are appended
+	to (or edited) through a copy, so the library keeps them as they were
+*/
+static struct lc_sequence *_sequence_copy(struct lc_sequence *seq)
+{
+	struct lc_sequence *copy;
+	unsigned i;
+	int err = 0;
+	if(IS_ERR(copy = _sequence_alloc()))
+		return copy;
+	for(i=0;i<seq->tracks_len && !err;i++)
+	{
+		copy->tracks[i] = seq->tracks[i];
+		err = _states_copy(&copy->tracks[i].states, &seq->tracks[i].states);
+		copy->tracks_len = i + 1;
+	}
+	for(i=0;i<seq->subs_len && !err;i++)
+	{
+		copy->subs[i] = seq->subs[i];
+		err = _states_copy(&copy->subs[i].track.states, &seq->subs[i].track.states);
+		copy->subs_len = i + 1;
+	}
+	if(err)
+	{
+		_sequence_free(copy);
+		return ERR_PTR(err);
+	}
+	copy->defining = seq->defining;
+	copy->writer = seq->writer;
+	copy->copy_of = seq;
+	return copy;
+}
+
+/* drop a reference, for sequences that may be in the library */
+static void _sequence_put(struct lc_sequence *seq)
+{
+	if(seq && refcount_dec_and_test(&seq->refs))
+		_sequence_free(seq);
+}
+
+/* the number of states, in all of the tracks, as written (for writers) */
+static unsigned _sequence_count(struct lc_sequence *seq)
+{
+	unsigned i, count = 0;
+	for(i=0;i<seq->tracks_len;i++)
+		count += seq->tracks[i].lines;
+	return count;
+}
+
+/*
+	The sequence's track for `leds`, added if it's new (for writers).
+	Tracks can't share leds, so frames can't be mixed with events
+*/
+static struct lc_track *_sequence_track(struct lc_sequence *seq, u32 leds)
+{
+	unsigned i;
+	for(i=0;i<seq->tracks_len;i++)
+	{
+		if(seq->tracks[i].leds == leds)
+			return &seq->tracks[i];
+		if(seq->tracks[i].leds & leds)
+			return ERR_PTR(-EINVAL);
+	}
+	// disjoint, so there's always room
+	seq->tracks[i].leds = leds;
+	// the runner can see it from here, still empty
+	smp_store_release(&seq->tracks_len, i + 1);
+	return &seq->tracks[i];
+}
+
+/* the sequence's track for `leds`, NULL if there's none */
+static struct lc_track *_sequence_track_find(struct lc_sequence *seq, u32 leds)
+{
+	unsigned i;
+	for(i=0;i<seq->tracks_len;i++)
+	{
+		if(seq->tracks[i].leds == leds)
+			return &seq->tracks[i];
+	}
+	return NULL;
+}
+
+/* whether a sub-pattern, or a repeated block, is still open (for writers) */
+static bool _sequence_open(struct lc_sequence *seq)
+{
+	unsigned i;
+	if(seq->defining >= 0)
+		return true;
+	for(i=0;i<seq->tracks_len;i++)
+	{
+		if(seq->tracks[i].depth)
+			return true;
+	}
+	return false;
+}
+
+/* the sub-pattern called `name`, -1 if there's none */
+static int _sequence_sub(struct lc_sequence *seq, const char *name)
+{
+	unsigned i;
+	for(i=0;i<seq->subs_len;i++)
+	{
+		if(!strcmp(seq->subs[i].name, name))
+			return i;
+	}
+	return -1;
+}
+
+/*
+	Open (`def`) or close (`enddef`) a sub-pattern (for writers).
+	Sub-patterns don't nest, and are only ever defined once
+*/
+static int _sequence_define(struct lc_sequence *seq, const struct lc_event *ev)
+{
+	struct lc_sub *sub;
+	if(LC_OP(ev->state.values) == LC_OP_ENDDEF)
+	{
+		if(seq->defining < 0 || seq->subs[seq->defining].track.depth)
+			return -EINVAL;
+		seq->defining = -1;
+		return 0;
+	}
+	if(seq->defining >= 0 || _sequence_sub(seq, ev->name) >= 0)
+		return -EINVAL;
+	if(seq->subs_len >= LC_SUBS_MAX)
+		return -ENOSPC;
+	sub = &seq->subs[seq->subs_len];
+	strscpy(sub->name, ev->name, LC_NAME_MAX);
+	seq->defining = seq->subs_len;
+	// readers can see it from here, still empty
+	smp_store_release(&seq->subs_len, seq->subs_len + 1);
+	return 0;
+}
+
+/*
+	Where `ev` goes (for writers): the sub-pattern being defined,
+	or the sequence's track for its leds.
+	`started` is set if a track gets its first states
+*/
+static struct lc_track *_sequence_dest(struct lc_sequence *seq, const struct lc_event *ev, bool *started)
+{
+	struct lc_track *track;
+	if(seq->defining >= 0)
+	{
+		track = &seq->subs[seq->defining].track;
+		// its leds are set by its first line
+		if(!track->states.count)
+			track->leds = ev->track;
+		return track->leds == ev->track ? track : ERR_PTR(-EINVAL);
+	}
+	track = _sequence_track(seq, ev->track);
+	if(!IS_ERR(track) && !track->states.count)
+		*started = true;
+	return track;
+}
+
+/*
+	Check an op against the blocks open on `track` (for writers), and
+	set how it's stored in `values`. The nesting is checked here, with
+	the sub-patterns' own, so the runner never goes deeper than LC_NEST_MAX,
+	and every repeated block has something to play
+*/
+static int _sequence_op(struct lc_sequence *seq, struct lc_track *track, const struct lc_event *ev, u32 *values)
+{
+	struct lc_track *sub;
+	int index;
+	*values = ev->state.values;
+	switch(LC_OP(ev->state.values))
+	{
+		case LC_OP_REPEAT:
+			if(track->depth >= LC_NEST_MAX)
+				return -EINVAL;
+			track->bare |= BIT(track->depth++);
+			track->max_depth = max(track->max_depth, track->depth);
+			return 0;
+		case LC_OP_END:
+			if(!track->depth || track->bare & BIT(track->depth-1))
+				return -EINVAL;
+			track->depth--;
+			return 0;
+		case LC_OP_CALL:
+			// defined before, so never itself
+			index = _sequence_sub(seq, ev->name);
+			if(index < 0 || index == seq->defining)
+				return -EINVAL;
+			sub = &seq->subs[index].track;
+			if(sub->states.count && sub->leds != track->leds)
+				return -EINVAL;
+			if(track->depth + 1 + sub->max_depth > LC_NEST_MAX)
+				return -EINVAL;
+			track->max_depth = max_t(u8, track->max_depth, track->depth + 1 + sub->max_depth);
+			if(sub->playable)
+			{
+				track->bare = 0;
+				track->playable = true;
+			}
+			*values = LC_OP_MAKE(LC_OP_CALL, index);
+			return 0;
+	}
+	return -EINVAL;
+}
+
+/*
+	Add `reps` lines of `state` after the `count` packed ones in `entries`,
+	as a run of the one before if it's the same. Returns the new count
+*/
+static unsigned _states_pack(struct lc_state *entries, unsigned count, const struct lc_state *state, unsigned reps)
+{
+	struct lc_state *prev = NULL, *run = NULL;
+	unsigned add;
+	if(count && _state_is_run(&entries[count-1]))
+	{
+		run = &entries[count-1];
+		prev = &entries[count-2];
+	}
+	else if(count)
+		prev = &entries[count-1];
+	while(reps)
+	{
+		if(prev && prev->time == state->time && prev->values == state->values)
+		{
+			if(!run)
+			{
+				run = &entries[count++];
+				*run = (struct lc_state){ LC_OP_MAKE(LC_OP_RUN, 0), 0 };
+			}
+			if((add = min(reps, LC_OP_ARG_MAX - LC_OP_ARG(run->values))))
+			{
+				run->values += add;
+				reps -= add;
+				continue;
+			}
+		}
+		// a state of its own
+		entries[count] = *state;
+		prev = &entries[count++];
+		run = NULL;
+		reps--;
+	}
+	return count;
+}
+
+/*
+	Edit `track` (for writers): the `remove` lines from `line` on are
+	replaced with the `count` states in `src`. Only the chunks they're in
+	are rebuilt, so it costs what's edited, not the whole track.
+
+	Only states can be edited, the ops around them stay as they are, and
+	so do the blocks, that can't be left empty
+*/
+static int _track_edit(struct lc_track *track, unsigned line, unsigned remove, const struct lc_state *src, unsigned count)
+{
+	struct lc_states *states = &track->states;
+	struct lc_state *entries, head, tail, *at;
+	unsigned first, last, skip = 0, keep = 0, rep, run, i, n = 0;
+	int err;
+	if(line > track->lines || remove > track->lines - line)
+		return -EINVAL;
+	// where it starts: the state of line `line`, and the lines of its run before it
+	first = line < track->lines ? _states_line(states, line, &skip) : states->count;
+	last = first;
+	if(skip)
+		head = *_states_at(states, first);
+	if(remove)
+	{
+		// where it ends, with the lines of the last run after it
+		last = _states_line(states, line + remove - 1, &rep);
+		tail = *_states_at(states, last);
+		run = _states_run(states, last);
+		keep = run - rep;
+		last += run ? 2 : 1;
+	}
+	else if(skip)
+	{
+		// inserting into a run splits it
+		tail = head;
+		run = _states_run(states, first);
+		keep = run + 1 - skip;
+		last = first + 2;
+	}
+	for(i=first;i<last;i++)
+	{
+		at = _states_at(states, i);
+		if(!at->time && !_state_is_run(at))
+			return -EINVAL;
+	}
+	if(!count && !skip && !keep && first && last < states->count
+		&& LC_OP(_states_at(states, first-1)->values) == LC_OP_REPEAT
+		&& LC_OP(_states_at(states, last)->values) == LC_OP_END)
+		return -EINVAL;
+
+	// the new states, with what's left of the runs around them
+	if(!(entries = kvmalloc_array(count + 8, sizeof(struct lc_state), GFP_KERNEL)))
+		return -ENOMEM;
+	if(skip)
+		n = _states_pack(entries, n, &head, skip);
+	for(i=0;i<count;i++)
+		n = _states_pack(entries, n, &src[i], 1);
+	if(keep)
+		n = _states_pack(entries, n, &tail, keep);
+	if(!(err = _states_splice(states, first, last, entries, n)))
+	{
+		track->lines += count - remove;
+		if(count)
+		{
+			track->bare = 0;
+			track->playable = true;
+		}
+	}
+	kvfree(entries);
+	return err;
+}
+
+/*
+	The runner is done with it, free it later
+	(as the runner may be in the timer callback)
+*/
+static void _sequence_retire(struct lc_states_dev *dev, struct lc_sequence *seq)
+{
+	// still saved, or played again: only the last reference is freed
+	if(refcount_dec_not_one(&seq->refs))
+		return;
+	llist_add(&seq->retired, &dev->retired);
+	schedule_work(&dev->retire_work);
+}
+
+static void _sequence_retire_work(struct work_struct *work)
+{
+	struct lc_states_dev *dev = container_of(work, struct lc_states_dev, retire_work);
+	struct lc_sequence *seq, *next;
+	llist_for_each_entry_safe(seq, next, llist_del_all(&dev->retired), retired)
+		_sequence_put(seq);
+}
+
+/*
+	Timers and GPIO
+
+	All the channels share a single timer and runner: the timer is set
+	for the earliest of their tracks' deadlines, and on each tick every
+	track that's due is stepped, their leds all set at once
+*/
+
+struct hrtimer states_hrtimer;
+
+/* signals for the runner thread, bit numbers in `runner_signals` */
+// timer finished, output the next state
+#define TSIGNAL_CNT 0
+// a channel was signalled, see its `signals`
+#define TSIGNAL_CHN 1
+// cleanup and exit thread
+#define TSIGNAL_EXT 2
+static unsigned long runner_signals = 0;
+
+/* channel signals, bit numbers in the channel's `signals` */
+// new states, start playing if not already
+#define CSIGNAL_STA 0
+// new states, start playing them right away
+#define CSIGNAL_NOW 1
+// a seek, from the controls
+#define CSIGNAL_SEEK 2
+
+DECLARE_WAIT_QUEUE_HEAD(wq);
+/* for whoever waits on a channel to stop */
+DECLARE_WAIT_QUEUE_HEAD(idle_wq);
+
+/*
+	What the runner went through, in debugfs: only ever written by the
+	runner (the timer or the thread, one at a time), read as they are
+*/
+static struct {
+	u64 timer_fires, runner_wakes, gpio_applies, sequence_swaps;
+	/*
+		- wakeup_latency -> from the timer signalling the thread to it running
+		- timer_lateness -> from when the timer was due to its callback
+		- gpio_apply     -> setting the leds, all of them
+	*/
+	struct lc_hist wakeup_latency, timer_lateness, gpio_apply;
+} lc_stats;
+
+/* when the timer last signalled the thread (0 once it's seen) */
+static ktime_t runner_kicked;
+
+static void _hist_add(struct lc_hist *hist, s64 ns)
+{
+	u64 value = ns > 0 ? ns : 0;
+	hist->count++;
+	hist->sum += value;
+	if(value > hist->max)
+		hist->max = value;
+	hist->buckets[value ? min_t(int, ilog2(value), LC_HIST_BUCKETS - 1) : 0]++;
+}
+
+/*
+	whether the timer callback steps the channels itself,
+	or leaves it to the runner thread (if any GPIO can sleep)
+*/
+static bool runner_direct;
+
+static void _runner_signal(int signal)
+{
+	set_bit(signal, &runner_signals);
+	wake_up(&wq);
+}
+
+static void _channel_signal(struct lc_states_dev *dev, int signal)
+{
+	set_bit(signal, &dev->signals);
+	_runner_signal(TSIGNAL_CHN);
+}
+
+/*
+	Readers of `leds->outputs`, SRCU as setting the GPIOs may sleep.
+	The runner never waits on whoever changes the pins
+*/
+DEFINE_STATIC_SRCU(lc_outputs_srcu);
+
+/*
+	Write the `changed` leds to their `values`, all in a single call
+*/
+static void _leds_output(struct leds *leds, u32 values, u32 changed, bool cansleep)
+{
+	struct gpio_desc *gpios[LEDS_MAX];
+	DECLARE_BITMAP(bitmap, LEDS_MAX);
+	struct lc_outputs *outs;
+	unsigned long pending;
+	unsigned count = 0;
+	int i, idx;
+	bitmap_zero(bitmap, LEDS_MAX);
+	idx = srcu_read_lock(&lc_outputs_srcu);
+	outs = srcu_dereference(leds->outputs, &lc_outputs_srcu);
+	pending = changed & LEDS_MASK(outs->count);
+	for_each_set_bit(i, &pending, LEDS_MAX)
+	{
+		if(!outs->gpios[i])
+		{
+			printk_ratelimited(KERN_WARNING "ledcontroller-t: GPIO output on unitialized LED\n");
+			continue;
+		}
+		if(values & BIT(i))
+			__set_bit(count, bitmap);
+		gpios[count++] = outs->gpios[i];
+	}
+	if(count && cansleep)
+		gpiod_set_array_value_cansleep(count, gpios, NULL, bitmap);
+	else if(count)
+		gpiod_set_array_value(count, gpios, NULL, bitmap);
+	srcu_read_unlock(&lc_outputs_srcu, idx);
+	leds->output = (leds->output & ~changed) | (values & changed);
+}
+
+/* whether any of the leds' GPIOs can sleep */
+static bool _leds_cansleep(struct leds *leds)
+{
+	struct lc_outputs *outs;
+	bool cansleep;
+	int idx = srcu_read_lock(&lc_outputs_srcu);
+	outs = srcu_dereference(leds->outputs, &lc_outputs_srcu);
+	cansleep = outs->cansleep & LEDS_MASK(outs->count);
+	srcu_read_unlock(&lc_outputs_srcu, idx);
+	return cansleep;
+}
+
+/*
+	Publish the leds' current GPIOs for the runner, as a new set.
+	The previous one is freed once no one's using it, callers
+	can only release the GPIOs that are gone after this
+*/
+static int _leds_publish(struct leds *leds)
+{
+	struct lc_outputs *outs, *prev;
+	int i;
+	if(!(outs = kzalloc(sizeof(struct lc_outputs), GFP_KERNEL)))
+		return -ENOMEM;
+	mutex_lock(&leds->outputs_mx);
+	outs->count = max(READ_ONCE(leds->led_count), 0);
+	for(i=0;i<outs->count;i++)
+	{
+		outs->gpios[i] = leds->leds[i]->gpio;
+		if(outs->gpios[i] && gpiod_cansleep(outs->gpios[i]))
+			outs->cansleep |= BIT(i);
+	}
+	prev = rcu_replace_pointer(leds->outputs, outs, lockdep_is_held(&leds->outputs_mx));
+	mutex_unlock(&leds->outputs_mx);
+	synchronize_srcu(&lc_outputs_srcu);
+	kfree(prev);
+	return 0;
+}
+
+/* the leds of a channel, that exist */
+static u32 _channel_leds(struct lc_states_dev *dev)
+{
+	return READ_ONCE(dev->leds_mask) & LEDS_MASK(dev->leds->led_count);
+}
+
+/*
+	The scheduler: the cursors of all the tracks being played, of all
+	the channels, in a min-heap by deadline. The timer is set for the
+	top one. Only ever touched by the runner
+*/
+
+static bool _cursor_less(const void *l, const void *r)
+{
+	return ktime_before((*(struct lc_cursor **)l)->deadline, (*(struct lc_cursor **)r)->deadline);
+}
+
+static void _cursor_swap(void *l, void *r)
+{
+	struct lc_cursor *tmp = *(struct lc_cursor **)l;
+	*(struct lc_cursor **)l = *(struct lc_cursor **)r;
+	*(struct lc_cursor **)r = tmp;
+}
+
+static const struct min_heap_callbacks lc_heap_callbacks = {
+	.elem_size = sizeof(struct lc_cursor *),
+	.less = _cursor_less,
+	.swp  = _cursor_swap
+};
+
+static struct lc_cursor *lc_heap_data[LC_CHANNELS_MAX * LEDS_MAX];
+static struct min_heap lc_heap = {
+	.data = lc_heap_data,
+	.nr   = 0,
+	.size = ARRAY_SIZE(lc_heap_data)
+};
+
+/* the GPIO changes of a tick, set all at once at its end */
+struct lc_tick {
+	u32 values;
+	u32 changed;
+	/* the channels that stopped, and the ones with new events, bit numbers are their index */
+	unsigned long stopped, events;
+};
+
+/* set the leds in `mask` to `values`, `all` of them, or only the ones that change */
+static void _tick_set(struct lc_tick *tick, u32 mask, u32 values, bool all)
+{
+	tick->changed |= all ? mask : (values ^ leds.output) & mask;
+	tick->values = (tick->values & ~mask) | (values & mask);
+}
+
+/*
+	Record an event for the files reading them (if any),
+	they're woken at the end of the tick
+*/
+static void _channel_event(struct lc_states_dev *dev, struct lc_tick *tick, const struct ledc_event *ev)
+{
+	unsigned long flags;
+	if(!atomic_read(&dev->listeners))
+		return;
+	raw_spin_lock_irqsave(&dev->events_lock, flags);
+	dev->events[dev->events_head++ & (LC_EVENTS_MAX - 1)] = *ev;
+	raw_spin_unlock_irqrestore(&dev->events_lock, flags);
+	__set_bit(dev->index, &tick->events);
+}
+
+/* the leds a track plays */
+static u32 _track_leds(struct lc_states_dev *dev, struct lc_track *track)
+{
+	return track->leds & dev->leds_mask;
+}
+
+/*
+	How many ops a cursor goes through looking for a state, so long runs
+	of them (or a track with nothing else) can't keep the runner going
+*/
+#define LC_STEP_OPS_MAX 1024
+
+/* leave the repeat block the cursor is in, or go through it again */
+static void _cursor_block_end(struct lc_cursor *c)
+{
+	struct lc_frame *f = &c->stack[c->depth-1];
+	if(f->remaining)
+	{
+		f->remaining--;
+		c->pos = f->pos;
+		c->edits = f->edits;
+	}
+	else
+		c->depth--;
+}
+
+/*
+	Get the cursor's next state, going through the ops on the way,
+	and set how long it holds: a run of it plays as a single state.
+	False if there's none, `wrapped` is set if it went back to the
+	start of the track for it.
+*/
+static bool _cursor_next(struct lc_cursor *c, struct lc_state *state, bool *wrapped)
+{
+	struct lc_state run;
+	struct lc_frame *f;
+	unsigned ops, i;
+	*wrapped = false;
+	// states may have been inserted or deleted before where it is
+	c->pos = _states_follow(&c->at->states, c->pos, &c->edits);
+	for(i=0;i<c->depth;i++)
+		c->stack[i].pos = _states_follow(&c->stack[i].at->states, c->stack[i].pos, &c->stack[i].edits);
+	for(ops=0;ops<LC_STEP_OPS_MAX;ops++)
+	{
+		/*
+			states may still be appended, or edited: it keeps going
+			from the same index, whatever is there now
+		*/
+		if(!_states_get(&c->at->states, c->pos, state))
+		{
+			if(c->depth && c->stack[c->depth-1].remaining != LC_FRAME_CALL)
+				// blocks still open at the end are closed there
+				_cursor_block_end(c);
+			else if(c->depth)
+			{
+				// back from the sub-pattern
+				f = &c->stack[--c->depth];
+				c->at = f->at;
+				c->pos = f->pos;
+				c->edits = f->edits;
+			}
+			else if(*wrapped)
+				// all the way through, and nothing to play
+				return false;
+			else
+			{
+				// end of the loop
+				*wrapped = true;
+				c->pos = 0;
+			}
+			continue;
+		}
+		c->pos++;
+		if(state->time)
+		{
+			c->index = c->pos - 1;
+			c->last = *state;
+			c->hold = state->time;
+			// the run that follows, if it's there yet
+			if(_states_get(&c->at->states, c->pos, &run) && _state_is_run(&run))
+			{
+				c->hold += (u64)state->time * LC_OP_ARG(run.values);
+				c->pos++;
+			}
+			return true;
+		}
+		/*
+			an op, the nesting is checked as they're added, but an edit
+			can leave the cursor somewhere else, so blocks may not match
+		*/
+		switch(LC_OP(state->values))
+		{
+			case LC_OP_REPEAT:
+				if(c->depth >= LC_NEST_MAX)
+					break;
+				f = &c->stack[c->depth++];
+				f->at = c->at;
+				f->pos = c->pos;
+				f->edits = c->edits;
+				f->remaining = LC_OP_ARG(state->values) - 1;
+				break;
+			case LC_OP_END:
+				if(c->depth && c->stack[c->depth-1].remaining != LC_FRAME_CALL)
+					_cursor_block_end(c);
+				break;
+			case LC_OP_CALL:
+				if(c->depth >= LC_NEST_MAX)
+					break;
+				f = &c->stack[c->depth++];
+				f->at = c->at;
+				f->pos = c->pos;
+				f->edits = c->edits;
+				f->remaining = LC_FRAME_CALL;
+				c->at = &c->dev->playing->subs[LC_OP_ARG(state->values)].track;
+				c->pos = 0;
+				// (the start stays where it is)
+				_states_follow(&c->at->states, 0, &c->edits);
+				break;
+			case LC_OP_RUN:
+				// appended after the state was played, the rest of it
+				c->hold = (u64)c->last.time * LC_OP_ARG(state->values);
+				*state = c->last;
+				return true;
+		}
+	}
+	return false;
+}
+
+/* output the cursor's `state`, due `at`, and schedule the one after */
+static void _cursor_play(struct lc_cursor *c, struct lc_state *state, ktime_t at, struct lc_tick *tick)
+{
+	struct lc_track *track = &c->dev->playing->tracks[c->track];
+	// only the ones that changed (all of them on start)
+	_tick_set(tick, _track_leds(c->dev, track), state->values, !c->started);
+	c->started = true;
+	/*
+		the next deadline is relative to this one, not to now,
+		so the time spent here doesn't add up from frame to frame.
+		At the channel's rate, but never due right away
+	*/
+	c->deadline = ktime_add_us(at, max_t(u64, mul_u64_u32_div(c->hold, LC_RATE_UNIT, READ_ONCE(c->dev->rate)), 1));
+	min_heap_push(&lc_heap, &c, &lc_heap_callbacks);
+	_channel_event(c->dev, tick, &(struct ledc_event){
+		.time = ktime_to_ns(at),
+		.reason = LEDC_EVENT_STATE,
+		.track = c->track,
+		.index = c->index,
+		.values = state->values
+	});
+}
+
+/*
+	Start the cursor on its track, from `at`.
+	False if the track has no states (yet).
+*/
+static bool _cursor_start(struct lc_cursor *c, ktime_t at, struct lc_tick *tick)
+{
+	struct lc_state state;
+	bool wrapped;
+	c->at = &c->dev->playing->tracks[c->track];
+	c->pos = 0;
+	c->depth = 0;
+	_states_follow(&c->at->states, 0, &c->edits);
+	if(!_cursor_next(c, &state, &wrapped))
+		return false;
+	_cursor_play(c, &state, at, tick);
+	return true;
+}
+
+/* take the channel's tracks off the scheduler */
+static void _channel_unschedule(struct lc_states_dev *dev)
+{
+	int i, nr = 0;
+	for(i=0;i<lc_heap.nr;i++)
+	{
+		if(lc_heap_data[i]->dev != dev)
+			lc_heap_data[nr++] = lc_heap_data[i];
+	}
+	lc_heap.nr = nr;
+	min_heapify_all(&lc_heap, &lc_heap_callbacks);
+}
+
+/* blank the channel's leds, it goes idle at the end of the tick */
+static void _channel_stop(struct lc_states_dev *dev, ktime_t at, struct lc_tick *tick)
+{
+	_tick_set(tick, dev->leds_mask, 0, true);
+	__set_bit(dev->index, &tick->stopped);
+	_channel_event(dev, tick, &(struct ledc_event){ .time = ktime_to_ns(at), .reason = LEDC_EVENT_STOP });
+}
+
+/*
+	Take the channel's tracks off the scheduler, to start over, with the
+	newly committed states (if any). Nothing is played, or told, yet
+*/
+static void _channel_reset(struct lc_states_dev *dev)
+{
+	struct lc_sequence *next;
+	unsigned i;
+	_channel_unschedule(dev);
+	if((next = xchg(&dev->pending, NULL)))
+	{
+		if(dev->playing)
+			_sequence_retire(dev, dev->playing);
+		dev->playing = next;
+		lc_stats.sequence_swaps++;
+		trace_ledc_sequence_swap(dev->index, smp_load_acquire(&next->tracks_len));
+	}
+	for(i=0;i<LEDS_MAX;i++)
+	{
+		dev->cursors[i].started = false;
+		dev->cursors[i].parked = false;
+	}
+	dev->paused = false;
+	dev->loops_done = 0;
+}
+
+/*
+	Start playing the newly committed states (if any) from `at`,
+	all the tracks together. Stops the channel if there's nothing to play
+*/
+static void _channel_start(struct lc_states_dev *dev, ktime_t at, struct lc_tick *tick)
+{
+	unsigned i, len;
+	bool any = false;
+	_channel_reset(dev);
+	len = smp_load_acquire(&dev->playing->tracks_len);
+	for(i=0;i<len;i++)
+	{
+		if(_cursor_start(&dev->cursors[i], at, tick))
+			any = true;
+	}
+	if(any)
+	{
+		WRITE_ONCE(dev->running, true);
+		_channel_event(dev, tick, &(struct ledc_event){ .time = ktime_to_ns(at), .reason = LEDC_EVENT_START });
+		return;
+	}
+	// nothing to play: blank its leds and go idle
+	_channel_stop(dev, at, tick);
+}
+
+/* start the tracks that got their first states while playing */
+static void _channel_resume(struct lc_states_dev *dev, ktime_t at, struct lc_tick *tick)
+{
+	unsigned i, len = smp_load_acquire(&dev->playing->tracks_len);
+	for(i=0;i<len;i++)
+	{
+		if(!dev->cursors[i].started)
+			_cursor_start(&dev->cursors[i], at, tick);
+	}
+}
+
+/* the track in `to` that's where `at` is in `from` (it's left as is if it's not there) */
+static struct lc_track *_sequence_same_track(struct lc_sequence *to, struct lc_sequence *from, struct lc_track *at)
+{
+	if(at >= from->tracks && at < from->tracks + LEDS_MAX)
+		return &to->tracks[at - from->tracks];
+	if(at >= &from->subs[0].track && at <= &from->subs[LC_SUBS_MAX-1].track)
+		return &to->subs[container_of(at, struct lc_sub, track) - from->subs].track;
+	return at;
+}
+
+/*
+	Appends to the saved states that are playing went to a copy of them:
+	the cursors go on in it from where they are, nothing starts over
+*/
+static void _channel_adopt(struct lc_states_dev *dev)
+{
+	struct lc_sequence *next = READ_ONCE(dev->pending), *prev = dev->playing;
+	struct lc_cursor *c;
+	unsigned i, j;
+	if(!next || !prev || next->copy_of != prev || cmpxchg(&dev->pending, next, NULL) != next)
+		return;
+	for(i=0;i<LEDS_MAX;i++)
+	{
+		c = &dev->cursors[i];
+		c->at = _sequence_same_track(next, prev, c->at);
+		for(j=0;j<c->depth;j++)
+			c->stack[j].at = _sequence_same_track(next, prev, c->stack[j].at);
+	}
+	dev->playing = next;
+	_sequence_retire(dev, prev);
+	lc_stats.sequence_swaps++;
+	trace_ledc_sequence_swap(dev->index, smp_load_acquire(&next->tracks_len));
+}
+
+/*
+	Hold the channel where it is: its tracks come off the scheduler,
+	with what's left of their states, the leds keep their values
+*/
+static void _channel_pause(struct lc_states_dev *dev, ktime_t now, struct lc_tick *tick)
+{
+	struct lc_cursor *c;
+	int i, nr = 0;
+	for(i=0;i<lc_heap.nr;i++)
+	{
+		c = lc_heap_data[i];
+		if(c->dev != dev)
+		{
+			lc_heap_data[nr++] = c;
+			continue;
+		}
+		c->parked = true;
+		c->left = ktime_before(now, c->deadline) ? ktime_sub(c->deadline, now) : 0;
+	}
+	lc_heap.nr = nr;
+	min_heapify_all(&lc_heap, &lc_heap_callbacks);
+	dev->paused = true;
+	_channel_event(dev, tick, &(struct ledc_event){ .time = ktime_to_ns(now), .reason = LEDC_EVENT_PAUSE });
+}
+
+/* and go on from there */
+static void _channel_unpause(struct lc_states_dev *dev, ktime_t now, struct lc_tick *tick)
+{
+	struct lc_cursor *c;
+	int i;
+	for(i=0;i<LEDS_MAX;i++)
+	{
+		c = &dev->cursors[i];
+		if(!c->parked)
+			continue;
+		c->parked = false;
+		c->deadline = ktime_add(now, c->left);
+		min_heap_push(&lc_heap, &c, &lc_heap_callbacks);
+	}
+	dev->paused = false;
+	_channel_event(dev, tick, &(struct ledc_event){ .time = ktime_to_ns(now), .reason = LEDC_EVENT_RESUME });
+}
+
+/*
+	Seek to `seek_to`, if it's still in the states that are (or are about
+	to be) played: the frames go on from there, the other tracks start
+	over. Only what's played from there is set, and told
+*/
+static void _channel_seek(struct lc_states_dev *dev, ktime_t now, struct lc_tick *tick)
+{
+	struct lc_sequence *next = READ_ONCE(dev->pending);
+	struct lc_cursor *c;
+	struct lc_state state;
+	unsigned i, len;
+	bool wrapped, any = false;
+	if(!next)
+		next = dev->playing;
+	// or appended to, through a copy (the lines are the same)
+	if(!next || (dev->seek_to.seq != next && dev->seek_to.seq != next->copy_of))
+		// committed over since
+		return;
+	_channel_reset(dev);
+	len = smp_load_acquire(&dev->playing->tracks_len);
+	for(i=0;i<len;i++)
+	{
+		c = &dev->cursors[i];
+		if(i != dev->seek_to.track)
+		{
+			if(_cursor_start(c, now, tick))
+				any = true;
+			continue;
+		}
+		c->at = &dev->playing->tracks[i];
+		c->pos = dev->seek_to.index;
+		c->edits = dev->seek_to.edits;
+		c->depth = 0;
+		if(!_cursor_next(c, &state, &wrapped))
+			continue;
+		// into a run, only the rest of it
+		if(!wrapped)
+			c->hold -= min_t(u64, c->hold - state.time, (u64)state.time * dev->seek_to.rep);
+		_cursor_play(c, &state, now, tick);
+		any = true;
+	}
+	if(any)
+		WRITE_ONCE(dev->running, true);
+	else
+		_channel_stop(dev, now, tick);
+}
+
+/* whether the channel played all of its loops, as its first track wraps */
+static bool _channel_looped(struct lc_states_dev *dev)
+{
+	unsigned loops = READ_ONCE(dev->loops);
+	return loops && ++dev->loops_done >= loops;
+}
+
+/*
+	Step a track that's due: to its next state, or to the newly committed
+	states, right away, or when the first track loops (as set by `commit_at`)
+*/
+static void _cursor_due(struct lc_cursor *c, struct lc_tick *tick)
+{
+	struct lc_states_dev *dev = c->dev;
+	bool pending = READ_ONCE(dev->pending), wrapped;
+	struct lc_state state;
+	int i;
+	if(pending && dev->commit_at != LC_COMMIT_LOOP)
+	{
+		_channel_start(dev, c->deadline, tick);
+		return;
+	}
+	if(!_cursor_next(c, &state, &wrapped))
+	{
+		// too many ops in a row: the track goes quiet, the channel too if it was the last
+		for(i=0;i<lc_heap.nr;i++)
+		{
+			if(lc_heap_data[i]->dev == dev)
+				return;
+		}
+		_channel_stop(dev, c->deadline, tick);
+		return;
+	}
+	if(wrapped)
+		_channel_event(dev, tick, &(struct ledc_event){
+			.time = ktime_to_ns(c->deadline),
+			.reason = LEDC_EVENT_LOOP,
+			.track = c->track
+		});
+	if(pending && wrapped && c->track == 0)
+		_channel_start(dev, c->deadline, tick);
+	else if(wrapped && c->track == 0 && _channel_looped(dev))
+	{
+		// the other tracks stop with it
+		_channel_unschedule(dev);
+		_channel_stop(dev, c->deadline, tick);
+	}
+	else
+		_cursor_play(c, &state, c->deadline, tick);
+}
+
+/*
+	Apply the channels' controls, start the ones that were signalled,
+	step the tracks that are due, and set their leds, all in a single
+	call. Returns the next deadline, 0 if nothing is playing.
+
+	Either in the timer callback, or in the thread with the timer stopped,
+	so there's only ever one of these running
+*/
+static ktime_t _runner_tick(bool cansleep)
+{
+	struct lc_states_dev *dev;
+	struct lc_cursor *c;
+	struct lc_tick tick = { 0 };
+	ktime_t now = ktime_get(), start;
+	int i;
+	bool pause;
+	s64 took;
+	for(i=0;i<lc_channels;i++)
+	{
+		dev = &lc_states_devs[i];
+		if(dev->running)
+			_channel_adopt(dev);
+		if(dev->seeking)
+		{
+			dev->seeking = false;
+			dev->starting = false;
+			_channel_seek(dev, now, &tick);
+		}
+		pause = READ_ONCE(dev->pause);
+		if(dev->paused && !pause)
+			_channel_unpause(dev, now, &tick);
+		// while paused, new tracks wait for it
+		if(dev->starting && !(dev->running && dev->paused))
+		{
+			dev->starting = false;
+			if(dev->running)
+				_channel_resume(dev, now, &tick);
+			else
+				// sequence start, deadlines are measured from here
+				_channel_start(dev, now, &tick);
+		}
+		if(pause && !dev->paused && READ_ONCE(dev->running))
+			_channel_pause(dev, now, &tick);
+	}
+	// the tracks that are due, in order
+	while(lc_heap.nr && !ktime_before(now, (c = lc_heap_data[0])->deadline))
+	{
+		min_heap_pop(&lc_heap, &lc_heap_callbacks);
+		_cursor_due(c, &tick);
+	}
+	if(tick.changed)
+	{
+		start = ktime_get();
+		_leds_output(&leds, tick.values, tick.changed, cansleep);
+		took = ktime_to_ns(ktime_sub(ktime_get(), start));
+		lc_stats.gpio_applies++;
+		_hist_add(&lc_stats.gpio_apply, took);
+		trace_ledc_gpio_apply(tick.values, tick.changed, took);
+	}
+	for_each_set_bit(i, &tick.stopped, LC_CHANNELS_MAX)
+		WRITE_ONCE(lc_states_devs[i].running, false);
+	if(tick.stopped)
+		wake_up(&idle_wq);
+	for_each_set_bit(i, &tick.events, LC_CHANNELS_MAX)
+		wake_up_interruptible_poll(&lc_states_devs[i].events_wq, EPOLLIN | EPOLLRDNORM);
+	return lc_heap.nr ? lc_heap_data[0]->deadline : 0;
+}
+
+static enum hrtimer_restart _states_hrtimer_callback(struct hrtimer *timer)
+{
+	ktime_t next, now = ktime_get();
+	s64 late = ktime_to_ns(ktime_sub(now, hrtimer_get_expires(timer)));
+	lc_stats.timer_fires++;
+	_hist_add(&lc_stats.timer_lateness, late);
+	trace_ledc_timer_fire(late, runner_direct);
+	if(runner_direct)
+	{
+		/*
+			none of the GPIOs sleep, step the channels right here,
+			nothing on the way takes a lock
+		*/
+		if(!(next = _runner_tick(false)))
+			return HRTIMER_NORESTART;
+		hrtimer_set_expires(timer, next);
+		return HRTIMER_RESTART;
+	}
+	runner_kicked = now;
+	_runner_signal(TSIGNAL_CNT);
+	return HRTIMER_NORESTART;
+}
+
+/* handle a channel's signals, with the timer stopped */
+static void _channel_signals(struct lc_states_dev *dev)
+{
+	if(test_and_clear_bit(CSIGNAL_NOW, &dev->signals))
+	{
+		if(dev->running && READ_ONCE(dev->pending))
+		{
+			// cut the current states short, start over with the committed ones
+			WRITE_ONCE(dev->running, false);
+			dev->starting = true;
+		}
+		else if(!dev->running)
+			dev->starting = true;
+		// else, nothing new, carry on
+	}
+	if(test_and_clear_bit(CSIGNAL_STA, &dev->signals))
+		dev->starting = true;
+	if(test_and_clear_bit(CSIGNAL_SEEK, &dev->signals))
+	{
+		// the timer can't take the lock, it's picked up here
+		spin_lock(&dev->seek_lock);
+		dev->seek_to = dev->seek;
+		spin_unlock(&dev->seek_lock);
+		dev->seeking = true;
+	}
+}
+
+static int _thread_gpio_runner(void *data)
+{
+	ktime_t next;
+	s64 latency;
+	int i;
+	// 1. infinite loop:
+	printk(KERN_DEBUG "ledcontroller-t: running thread\n");
+	while(1)
+	{
+		wait_event(wq, READ_ONCE(runner_signals));
+		// the timer doesn't fire again before it's re-armed, below
+		latency = 0;
+		if(runner_kicked)
+		{
+			latency = ktime_to_ns(ktime_sub(ktime_get(), runner_kicked));
+			_hist_add(&lc_stats.wakeup_latency, latency);
+			runner_kicked = 0;
+		}
+		lc_stats.runner_wakes++;
+		trace_ledc_runner_wake(READ_ONCE(runner_signals), latency);
+		// the timer may be re-arming itself, stop it, the channels are ours now
+		hrtimer_cancel(&states_hrtimer);
+		if(test_and_clear_bit(TSIGNAL_EXT, &runner_signals))
+		{
+			// clean out GPIO
+			_leds_output(&leds, 0, LEDS_MASK(LEDS_MAX), true);
+			printk(KERN_DEBUG "ledcontroller-t: exit on signal\n");
+			return 0;
+		}
+		clear_bit(TSIGNAL_CNT, &runner_signals);
+		if(test_and_clear_bit(TSIGNAL_CHN, &runner_signals))
+		{
+			for(i=0;i<lc_channels;i++)
+				_channel_signals(&lc_states_devs[i]);
+		}
+		if((next = _runner_tick(true)))
+		{
+			// from now on, can the timer do it by itself?
+			WRITE_ONCE(runner_direct, !_leds_cansleep(&leds));
+			hrtimer_start(&states_hrtimer, next, HRTIMER_MODE_ABS_HARD);
+		}
+	}
+	printk(KERN_WARNING "ledcontroller-t: weird exit from thread function!\n");
+	return 0;
+}
+
+
+/*
+	States, CharDev I/O
+*/
+
+/*
+	State time values are kept in microseconds.
+
+	On the text format, the time field takes an optional unit suffix:
+	`us`, `ms` or `s`; without one, it's in seconds (as it always was).
+
+	Kept in 32 bits, a state lasts at most U32_MAX microseconds (a bit
+	over 71 minutes, `4294s`), longer ones fail with -ERANGE: hold it
+	over several lines instead.
+*/
+static int _parse_time(char *str, unsigned *time)
+{
+	size_t len = strlen(str);
+	unsigned unit = USEC_PER_SEC, value;
+	int err;
+	if(len > 2 && !strcmp(str+len-2, "us"))
+	{
+		unit = 1;
+		str[len-2] = 0;
+	}
+	else if(len > 2 && !strcmp(str+len-2, "ms"))
+	{
+		unit = USEC_PER_MSEC;
+		str[len-2] = 0;
+	}
+	else if(len > 1 && str[len-1] == 's')
+	{
+		str[len-1] = 0;
+	}
+	if((err = kstrtou32(str, 10, &value)))
+		return err;
+	if(value > U32_MAX / unit)
+		return -ERANGE;
+	*time = value * unit;
+	return 0;
+}
+
+/* the longest text representation of a state, with the NULL byte */
+#define LC_STATE_REPR_MAX (2*LEDS_MAX + 24)
+
+/*
+	Render a state (of `track`) as text, returns its length.
+
+	Only what's stored is shown: led values as 0 or 1, and times with
+	the biggest unit that keeps them exact, not the one they were
+	written with.
+*/
+static int _state_repr(struct lc_states_dev *dev, struct lc_track *track, struct lc_state *node, char buffer[LC_STATE_REPR_MAX])
+{
+	int i, offset = 0;
+	unsigned time = node->time;
+	unsigned long mask = _channel_leds(dev);
+	const char *unit = "us";
+	if(track->leds != LC_TRACK_FRAMES && track->leds)
+	{
+		// events, the track's leds: `@led[-last]:`
+		int first = __ffs(track->leds), last = __fls(track->leds);
+		if(first == last)
+			offset += sprintf(buffer, "@%d:", first);
+		else
+			offset += sprintf(buffer, "@%d-%d:", first, last);
+		mask = track->leds;
+	}
+	if(!time)
+	{
+		// an op
+		switch(LC_OP(node->values))
+		{
+			case LC_OP_REPEAT:
+				offset += sprintf(buffer+offset, "repeat %u\n", LC_OP_ARG(node->values));
+				break;
+			case LC_OP_END:
+				offset += sprintf(buffer+offset, "end\n");
+				break;
+			case LC_OP_CALL:
+				offset += sprintf(buffer+offset, "call %s\n", dev->seq->subs[LC_OP_ARG(node->values)].name);
+				break;
+		}
+		return offset;
+	}
+	// led values
+	for_each_set_bit(i, &mask, LEDS_MAX)
+	{
+		buffer[offset++] = node->values & BIT(i) ? '1' : '0';
+		buffer[offset++] = ',';
+	}
+	// and the time
+	if(!(time % USEC_PER_SEC))
+	{
+		time /= USEC_PER_SEC;
+		unit = "";
+	}
+	else if(!(time % USEC_PER_MSEC))
+	{
+		time /= USEC_PER_MSEC;
+		unit = "ms";
+	}
+	offset += snprintf(buffer+offset, LC_STATE_REPR_MAX-offset, "%u%s\n", time, unit);
+	return offset;
+}
+
+/*
+	Reads go through seq_file, iterating over the lines by index, runs
+	expanded (through the sub-patterns, then the tracks, in order): sequential reads
+	pick up where the last one stopped, and the text is rendered straight
+	into the seq_file buffer
+*/
+
+#define LC_LINE_STATE  0
+#define LC_LINE_DEF    1
+#define LC_LINE_ENDDEF 2
+
+/* the file's read position, on line `line` of `track` */
+static struct lc_state *_file_read_line(struct lc_file *lcf, struct lc_track *track, unsigned line)
+{
+	lcf->read_line = LC_LINE_STATE;
+	lcf->read_track = track;
+	lcf->read_index = _states_line(&track->states, line, &lcf->read_rep);
+	return _states_at(&track->states, lcf->read_index);
+}
+
+/* the line after the file's read position, if it's in the same track */
+static struct lc_state *_file_read_next(struct lc_file *lcf)
+{
+	struct lc_track *track = lcf->read_track;
+	unsigned run = _states_run(&track->states, lcf->read_index);
+	if(lcf->read_rep < run)
+		lcf->read_rep++;
+	else if(lcf->read_index + (run ? 2 : 1) < track->states.count)
+	{
+		lcf->read_index += run ? 2 : 1;
+		lcf->read_rep = 0;
+	}
+	else
+		return NULL;
+	return _states_at(&track->states, lcf->read_index);
+}
+
+static void *_file_read_seek(struct lc_file *lcf, loff_t pos)
+{
+	struct lc_sequence *seq = lcf->dev->seq;
+	unsigned i, lines;
+	for(i=0;i<seq->subs_len;i++)
+	{
+		lcf->read_sub = &seq->subs[i];
+		lines = seq->subs[i].track.lines;
+		if(pos == 0)
+		{
+			lcf->read_line = LC_LINE_DEF;
+			return lcf->read_sub;
+		}
+		if(pos <= lines)
+			return _file_read_line(lcf, &seq->subs[i].track, pos - 1);
+		// the one being defined isn't closed yet
+		if(seq->defining == i)
+			pos -= lines + 1;
+		else if(pos == lines + 1)
+		{
+			lcf->read_line = LC_LINE_ENDDEF;
+			return lcf->read_sub;
+		}
+		else
+			pos -= lines + 2;
+	}
+	for(i=0;i<seq->tracks_len;i++)
+	{
+		if(pos < seq->tracks[i].lines)
+			return _file_read_line(lcf, &seq->tracks[i], pos);
+		pos -= seq->tracks[i].lines;
+	}
+	return NULL;
+}
+
+/*
+	The line at `pos`: runs are stored once, so it's found by going
+	through the states, unless it's the one after the last read
+*/
+static void *_file_read_at(struct lc_file *lcf, loff_t pos)
+{
+	struct lc_states_dev *dev = lcf->dev;
+	void *line = NULL;
+	bool cached = lcf->read_commits == dev->commits && lcf->read_line == LC_LINE_STATE
+		&& lcf->read_track;
+	// (a read picks up on the line the last one stopped at)
+	if(cached && pos == lcf->read_pos)
+		line = _states_at(&lcf->read_track->states, lcf->read_index);
+	else if(cached && pos == lcf->read_pos + 1)
+		line = _file_read_next(lcf);
+	if(!line)
+		line = _file_read_seek(lcf, pos);
+	lcf->read_pos = pos;
+	lcf->read_commits = dev->commits;
+	return line;
+}
+
+static void *lc_states_seq_start(struct seq_file *m, loff_t *pos)
+{
+	struct lc_file *lcf = (struct lc_file*)m->private;
+	// released on `stop`, which is always called
+	down_read(&lcf->dev->semaphore);
+	return _file_read_at(lcf, *pos);
+}
+
+static void *lc_states_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	(*pos)++;
+	return _file_read_at((struct lc_file*)m->private, *pos);
+}
+
+static void lc_states_seq_stop(struct seq_file *m, void *v)
+{
+	struct lc_states_dev *dev = ((struct lc_file*)m->private)->dev;
+	up_read(&dev->semaphore);
+}
+
+static int lc_states_seq_show(struct seq_file *m, void *v)
+{
+	char buffer[LC_STATE_REPR_MAX];
+	struct lc_file *lcf = (struct lc_file*)m->private;
+	int length;
+	if(lcf->read_line == LC_LINE_DEF)
+		seq_printf(m, "def %s\n", lcf->read_sub->name);
+	else if(lcf->read_line == LC_LINE_ENDDEF)
+		seq_puts(m, "enddef\n");
+	else
+	{
+		length = _state_repr(lcf->dev, lcf->read_track, (struct lc_state*)v, buffer);
+		seq_write(m, buffer, length);
+	}
+	return 0;
+}
+
+static const struct seq_operations lc_states_seq_ops = {
+	.start = lc_states_seq_start,
+	.next  = lc_states_seq_next,
+	.stop  = lc_states_seq_stop,
+	.show  = lc_states_seq_show
+};
+
+/* the file's private data is the seq_file, ours is in there */
+static struct lc_file *_file_data(struct file *filp)
+{
+	return (struct lc_file*)((struct seq_file*)filp->private_data)->private;
+}
+
+/*
+	Make `seq` the current states; the runner switches to them on its
+	own time (see `commit_at`), except for empty ones, that stop it
+	right away, and we wait for that
+*/
+static void _sequence_commit(struct lc_states_dev *dev, struct lc_sequence *seq)
+{
+	struct lc_sequence *prev;
+	unsigned count = _sequence_count(seq);
+	bool clear = !count;
+	down_write(&dev->semaphore);
+	dev->seq = seq;
+	dev->commits++;
+	prev = xchg(&dev->pending, seq);
+	up_write(&dev->semaphore);
+	// never picked up by the runner (but maybe in the library)
+	_sequence_put(prev);
+
+	_channel_signal(dev, clear || dev->commit_at == LC_COMMIT_NOW ? CSIGNAL_NOW : CSIGNAL_STA);
+	if(clear)
+		wait_event(idle_wq, READ_ONCE(dev->pending) != seq
+			&& (READ_ONCE(dev->playing) != seq || !READ_ONCE(dev->running)));
+}
+
+static int lc_states_open(struct inode *inode, struct file *filp)
+{
+	int ret;
+	struct lc_file *lcf = kzalloc(sizeof(struct lc_file), GFP_KERNEL);
+	if(!lcf)
+		return -ENOMEM;
+	lcf->dev = (struct lc_states_dev*)inode->i_cdev;
+	mutex_init(&lcf->write_mx);
+	if(!(filp->f_flags & O_APPEND) && (filp->f_mode&FMODE_WRITE))
+	{
+		/*
+			write without append, assume truncate: upload to new states,
+			the current ones keep playing until these are committed
+		*/
+		if(IS_ERR(lcf->staging = _sequence_alloc()))
+		{
+			ret = PTR_ERR(lcf->staging);
+			kfree(lcf);
+			return ret;
+		}
+	}
+	// else, just append
+
+	if((ret = seq_open(filp, &lc_states_seq_ops)))
+	{
+		_sequence_free(lcf->staging);
+		kfree(lcf);
+		return ret;
+	}
+	((struct seq_file*)filp->private_data)->private = lcf;
+	return 0;
+}
+
+/* the file is closed, the blocks it left open are anyone's to close */
+static void _file_blocks_release(struct lc_file *lcf)
+{
+	struct lc_states_dev *dev = lcf->dev;
+	int i;
+	down_write(&dev->semaphore);
+	if(dev->seq->writer == lcf)
+		dev->seq->writer = NULL;
+	// (or they were saved like that)
+	for(i=0;i<LC_LIBRARY_MAX;i++)
+	{
+		if(dev->library[i].seq && dev->library[i].seq->writer == lcf)
+			dev->library[i].seq->writer = NULL;
+	}
+	up_write(&dev->semaphore);
+}
+
+static int lc_states_release(struct inode *inode, struct file *filp)
+{
+	struct lc_file *lcf = _file_data(filp);
+	if(lcf->staging && lcf->lost)
+	{
+		// rather than a truncated sequence, keep the current one
+		printk(KERN_WARNING "ledcontroller: upload ran out of memory, not committed\n");
+		_sequence_free(lcf->staging);
+	}
+	else if(lcf->staging)
+		_sequence_commit(lcf->dev, lcf->staging);
+	else if(filp->f_mode & FMODE_WRITE)
+		_file_blocks_release(lcf);
+	if(lcf->events)
+		atomic_dec(&lcf->dev->listeners);
+	// an incomplete last line is dropped
+	kfree(lcf->partial);
+	kfree(lcf->batch);
+	kfree(lcf);
+	return seq_release(inode, filp);
+}
+
+/*
+	Parse a single line (NULL terminated, without the newline) into `event`.
 
-int lc_dev_major = 0;
-int lc_dev_minor = 0;
-#define LC_MINOR_COUNT 1
+	A line is either a frame, with a value for each of the channel's leds,
+	or an event for some of them, `@led[-last]:`, followed by their values,
+	these go in their own track.
+
+	Or an op (on a track too):
+	- `repeat N` ... `end`: the block in between, N times
+	- `def name` ... `enddef`: a sub-pattern (no track, it gets the caller's)
+	- `call name`: a sub-pattern, defined before
+*/
+static int _parse_op(char *it, struct lc_event *event, bool prefixed)
+{
+	char *arg = strchr(it, ' ');
+	u32 count;
+	if(arg)
+		*arg++ = 0;
+	if(!strcmp(it, "end") || !strcmp(it, "enddef"))
+	{
+		if(arg)
+			return -EINVAL;
+		if(it[3] && prefixed)
+			return -EINVAL;
+		event->state.values = LC_OP_MAKE(it[3] ? LC_OP_ENDDEF : LC_OP_END, 0);
+		return 0;
+	}
+	if(!arg)
+		return -EINVAL;
+	if(!strcmp(it, "repeat"))
+	{
+		if(kstrtou32(arg, 10, &count) || !count || count > LC_OP_ARG_MAX)
+			return -EINVAL;
+		event->state.values = LC_OP_MAKE(LC_OP_REPEAT, count);
+		return 0;
+	}
+	// a name, no spaces in it
+	if(!*arg || strchr(arg, ' ') || strlen(arg) >= LC_NAME_MAX)
+		return -EINVAL;
+	strscpy(event->name, arg, LC_NAME_MAX);
+	if(!strcmp(it, "call"))
+		event->state.values = LC_OP_MAKE(LC_OP_CALL, 0);
+	else if(!strcmp(it, "def") && !prefixed)
+		event->state.values = LC_OP_MAKE(LC_OP_DEF, 0);
+	else
+		return -EINVAL;
+	return 0;
+}
 
-struct lc_states_dev lc_states_dev;
+static int _parse_state(struct lc_states_dev *dev, char *line, struct lc_event *event)
+{
+	char *it = line, *comma, *colon, *dash;
+	unsigned long mask = _channel_leds(dev);
+	struct lc_state *state = &event->state;
+	u8 first, last;
+	s8 value;
+	int i;
+	memset(event, 0, sizeof(struct lc_event));
+	event->track = LC_TRACK_FRAMES;
+	if(*it == '@')
+	{
+		if(!(colon = strchr(it, ':')))
+			return -EINVAL;
+		*colon = 0;
+		if((dash = strchr(it, '-')))
+			*dash = 0;
+		if(kstrtou8(it+1, 10, &first))
+			return -EINVAL;
+		last = first;
+		if(dash && kstrtou8(dash+1, 10, &last))
+			return -EINVAL;
+		if(first > last || last >= LEDS_MAX)
+			return -EINVAL;
+		// only the channel's leds
+		if(GENMASK(last, first) & ~mask)
+			return -EINVAL;
+		mask = event->track = GENMASK(last, first);
+		it = colon+1;
+	}
+	if(isalpha(*it))
+		return _parse_op(it, event, event->track != LC_TRACK_FRAMES);
+	// led values, one for each
+	for_each_set_bit(i, &mask, LEDS_MAX)
+	{
+		if(!(comma = strchr(it, ',')))
+			return -EINVAL;
+		*comma = 0;	// set NULL byte
+		if(kstrtos8(it, 10, &value))
+			return -EINVAL;
+		// anything but 0 is on
+		if(value)
+			state->values |= BIT(i);
+		// next item
+		it = comma+1;
+	}
+	// `it` should be at the time value
+	if(_parse_time(it, &state->time) || state->time < 1)
+		return -EINVAL;
+	return 0;
+}
 
 /*
-	Timers and GPIO
+	Parse the complete lines in the file's partial buffer into its batch,
+	until it's full. `consumed` is set to how much of the buffer was used,
+	and `parsed` to the number of states in the batch.
+
+	Invalid lines are dropped, but stop the parsing.
 */
+static int _parse_lines(struct lc_file *lcf, size_t *consumed, unsigned *parsed)
+{
+	char *line = lcf->partial, *newline, *end = lcf->partial + lcf->partial_len;
+	unsigned count = 0;
+	int err = 0;
+	while(!err && count < LC_BATCH_STATES && (newline = memchr(line, '\n', end - line)))
+	{
+		if(newline != line)
+		{
+			*newline = 0;
+			if((err = _parse_state(lcf->dev, line, &lcf->batch[count])))
+				printk_ratelimited(KERN_DEBUG "ledcontroller: dropping invalid line\n");
+			else
+				count++;
+		}
+		// else, empty line, ignore it
+		line = newline+1;
+	}
+	*consumed = line - lcf->partial;
+	*parsed = count;
+	return err;
+}
 
-struct hrtimer states_hrtimer;
+/*
+	Writes are copied in, a buffer at a time, behind what's left of the
+	previous one (at most a line), so each byte is only copied and parsed
+	once, whatever the size of the write.
 
-// default/empty
-#define TSIGNAL_NOT 0
-// continue scheduling, timer finished
-#define TSIGNAL_CNT 1
-// cancel scheduling, cleanup, wait for new events
-#define TSIGNAL_CAN 2
-// cleanup and exit thread
-#define TSIGNAL_EXT 3
-static int timer_signal = 0;
+	The buffer is the file's own, so is the parsing: writers on different
+	files only meet to append their parsed states, a batch at a time.
+*/
+#define LC_PARTIAL_SIZE PAGE_SIZE
 
-DECLARE_WAIT_QUEUE_HEAD(wq);
+/* whether all of the channel's leds have a pin, writes aren't allowed until then */
+static int _leds_all_set(struct lc_states_dev *dev)
+{
+	struct leds *leds = dev->leds;
+	unsigned long mask;
+	int all_set = 1, i;
+	down_read(&leds->rw_semaphore);
+	mask = _channel_leds(dev);
+	for_each_set_bit(i, &mask, LEDS_MAX)
+	{
+		if(!leds->leds[i]->gpio)
+			all_set = 0;
+	}
+	up_read(&leds->rw_semaphore);
+	if(!all_set)
+		printk(KERN_WARNING "ledcontroller: attempt to write before all pins are set\n");
+	return all_set;
+}
 
-static enum hrtimer_restart _states_hrtimer_callback(struct hrtimer *timer)
+/* the leds can't change while there are states, or they're still playing */
+static int _states_busy(struct lc_states_dev *dev)
 {
-	printk(KERN_DEBUG "ledcontroller: signal in timer callback\n");
-	timer_signal = TSIGNAL_CNT;
-	wake_up(&wq);
-	return HRTIMER_NORESTART;
+	int busy, i;
+	down_read(&dev->semaphore);
+	busy = _sequence_count(dev->seq) || READ_ONCE(dev->running);
+	// saved ones too, they're for these leds
+	for(i=0;i<LC_LIBRARY_MAX;i++)
+	{
+		if(dev->library[i].seq)
+			busy = 1;
+	}
+	up_read(&dev->semaphore);
+	return busy;
 }
 
-static int _thread_gpio_runner(void *data)
+/* the leds are shared, so any channel */
+static int _channels_busy(void)
 {
-	struct lc_states_dev *dev = (struct lc_states_dev*)data;
 	int i;
-	// 1. infinite loop:
-	printk(KERN_DEBUG "ledcontroller-t: running thread\n");
-	while(1)
+	for(i=0;i<lc_channels;i++)
 	{
-		printk(KERN_DEBUG "ledcontroller-t: got signal: %d\n", timer_signal);
-		switch(timer_signal)
-		{
-			case TSIGNAL_NOT:	// first iteration
-			{
-				// do nothing
-				break;
-			}
-			case TSIGNAL_CNT:
-			{
-				down_read(&dev->semaphore);
-				// move cursor
-				if(!dev->cur||dev->cur==dev->tail)
-					// unititialized/end
-					dev->cur = dev->head;
-				else
-					dev->cur = dev->cur->next;
-				if(!dev->cur)
-				{
-					printk(KERN_WARNING "ledcontroller-t: timer IRQ on empty state list\n");
-					up_read(&dev->semaphore);
-					break;
-				}
-				// output gpio
-				down_read(&dev->leds->rw_semaphore);
-				for(i=0;i<dev->leds->led_count;i++)
-				{
-					if(dev->leds->leds[i]->gpio)
-					{
-						printk(KERN_DEBUG "ledcontroller-t: led %d value %d\n", i, dev->cur->led_values[i]);
-						gpiod_set_value(dev->leds->leds[i]->gpio, dev->cur->led_values[i]);
-					}
-					else
-						printk(KERN_WARNING "ledcontroller-t: GPIO output on unitialized LED\n");
-				}
-				up_read(&dev->leds->rw_semaphore);
-				// setup new timer
-				hrtimer_start(&states_hrtimer, ms_to_ktime(dev->cur->time * 1000), HRTIMER_MODE_REL);
-				up_read(&dev->semaphore);
-				break;
-			}
-			case TSIGNAL_CAN:
-			case TSIGNAL_EXT:
-			{
-				// clean out GPIO
-				down_read(&dev->leds->rw_semaphore);
-				for(i=0;i<dev->leds->led_count;i++)
-				{
-					if(dev->leds->leds[i]->gpio)
-						gpiod_set_value(dev->leds->leds[i]->gpio, 0);
-					else
-						printk(KERN_WARNING "ledcontroller: GPIO output on unitialized LED\n");
-				}
-				up_read(&dev->leds->rw_semaphore);
-				if(timer_signal==TSIGNAL_EXT)
-				{
-					printk(KERN_DEBUG "ledcontroller-t: exit on signal\n");
-					return 0;
-				}
-				break;
-			}
-		}
-		printk(KERN_DEBUG "ledcontroller-t: waiting for new event\n");
-		timer_signal = 0;
-		wait_event(wq, timer_signal);
+		if(_states_busy(&lc_states_devs[i]))
+			return 1;
 	}
-	printk(KERN_WARNING "ledcontroller-t: weird exit from thread function!\n");
 	return 0;
 }
 
-
 /*
-	Linked List, CharDev I/O
-*/
+	Where the file's writes go, with the semaphore held when needed
+	(staged states are only this file's), -EBUSY while another file
+	has blocks open.
 
-static int lc_states_open(struct inode *inode, struct file *filp)
+	Saved states are kept as they were saved: the writes go to a copy,
+	committed in their place, played from the next frame (or loop) on
+*/
+static struct lc_sequence *_file_states_lock(struct lc_file *lcf)
 {
-	filp->private_data = inode->i_cdev;
-	if(!(filp->f_flags & O_APPEND) && (filp->f_mode&FMODE_WRITE))
+	struct lc_states_dev *dev = lcf->dev;
+	struct lc_sequence *seq, *prev;
+	if(lcf->staging)
+		return lcf->staging;
+	down_write(&dev->semaphore);
+	seq = dev->seq;
+	if(seq->writer && seq->writer != lcf)
 	{
-		/* write without append, assume truncate: clean state */
-		struct lc_states_dev *dev = (struct lc_states_dev*)inode->i_cdev;
-		//struct leds *leds = dev->leds;
-		/* stop timers and clear LED outputs */
-		printk(KERN_DEBUG "ledcontroller: file open as TRUNC, cancelling timers\n");
-		hrtimer_cancel(&states_hrtimer);
-		timer_signal = TSIGNAL_CAN;
-		wake_up(&wq);
-		printk(KERN_DEBUG "ledcontroller: continuing `open`\n");
-		/* clear linked-lists */
-		down_write(&dev->semaphore);
-		/* `cur` is iterator, `head` is next*/
-		for(dev->cur = dev->head; dev->cur; dev->cur = dev->head)
-		{
-			dev->head = dev->cur->next;
-			kfree(dev->cur->led_values);
-			kfree(dev->cur);
-		}
-		dev->head = dev->cur = dev->tail = NULL;
+		// what it appends would end up in them
 		up_write(&dev->semaphore);
+		return ERR_PTR(-EBUSY);
 	}
-	// else, just append
-
-	return 0;
+	if(seq->saved)
+	{
+		if(IS_ERR(seq = _sequence_copy(seq)))
+		{
+			up_write(&dev->semaphore);
+			return seq;
+		}
+		dev->seq = seq;
+		dev->commits++;
+		// never picked up by the runner (but maybe still in the library)
+		prev = xchg(&dev->pending, seq);
+		_sequence_put(prev);
+	}
+	return seq;
 }
 
-static int lc_states_release(struct inode *inode, struct file *filp)
+static void _file_states_unlock(struct lc_file *lcf)
 {
-	/* nothing to be done here */
-	return 0;
+	if(!lcf->staging)
+		up_write(&lcf->dev->semaphore);
 }
 
-static ssize_t lc_states_read(struct file *filp, char __user *buf, size_t count, loff_t *fpos)
+/*
+	Append `count` states to the file's states, only holding them for the copy.
+	`started` is set if a track got its first states
+*/
+static int _file_states_append(struct lc_file *lcf, const struct lc_event *src, unsigned count, bool *started)
 {
-	struct lc_states_dev *dev = (struct lc_states_dev*)filp->private_data;
-	size_t total_read = 0,
-	       entry_offset = 0,
-		   space_left = count;
-	size_t read_offset = (size_t)*fpos;
-	size_t to_skip = (size_t)*fpos;
-	struct ll_node *ptr;
-	down_read(&dev->semaphore);
-	// 1. skip to target offset
-	for(ptr = dev->head; ptr; ptr = ptr->next)
+	struct lc_sequence *seq;
+	struct lc_track *track;
+	struct lc_state *slots;
+	unsigned run, done = 0, i;
+	u32 values;
+	int err = 0;
+	if(!count)
+		return 0;
+	if(IS_ERR(seq = _file_states_lock(lcf)))
+		return PTR_ERR(seq);
+	while(done < count)
 	{
-		if(to_skip < ptr->repr_size)
+		if(LC_OP(src[done].state.values) >= LC_OP_DEF && !src[done].state.time)
 		{
-			entry_offset = to_skip;
+			if((err = _sequence_define(seq, &src[done])))
+				break;
+			done++;
+			continue;
+		}
+		track = _sequence_dest(seq, &src[done], started);
+		if(IS_ERR(track))
+		{
+			err = PTR_ERR(track);
 			break;
 		}
-		// else
-		to_skip -= ptr->repr_size;
-	}
-	// 2. read while it fits in buffer
-	while(space_left > 0 && ptr)
-	{
-		// 2.1 transform state into str
-		// get state buffer
-		unsigned buffer_offset = 0, buffer_length = ptr->repr_size+1;
-		size_t needed = ptr->repr_size - entry_offset;
-		int i;
-		char *state_buffer = (char*)kmalloc(buffer_length, GFP_KERNEL);
-		if(!state_buffer)
-		{
-			up_read(&dev->semaphore);
-			return -ENOMEM;
-		}
-		// led values
-		for(i=0;i<dev->leds->led_count;i++)
-		{
-			buffer_offset += snprintf(
-				state_buffer+buffer_offset,
-				buffer_length-buffer_offset,
-				"%hhu,", ptr->led_values[i]
-			);
-		}
-		// and the time
-		snprintf(state_buffer+buffer_offset, buffer_length-buffer_offset, "%u\n", ptr->time);
-		// 2.2 copy data to user
-		size_t to_copy = space_left > needed ? needed : space_left;
-		size_t copied = to_copy - copy_to_user(buf + total_read, state_buffer+entry_offset, to_copy);
-		kfree(state_buffer); state_buffer = NULL;
-		total_read += copied;
-		read_offset += copied;
-		space_left -= copied;
-		if(copied != to_copy)
-		{
-			/* TODO: consider having this comparing to 0 (zero) instead */
-			// failed to copy the full thing
-			// let's just return
+		if(IS_ERR(slots = _states_reserve_run(&track->states, &run)))
+		{
+			err = PTR_ERR(slots);
 			break;
 		}
-		// prepare next loop
-		entry_offset += copied;
-		if(entry_offset >= ptr->repr_size)
-			/* it should never be ` > repr_size` */
-			entry_offset = 0;
-		ptr = ptr->next;
+		if(!src[done].state.time)
+		{
+			// an op, on its own
+			if((err = _sequence_op(seq, track, &src[done], &values)))
+				break;
+			slots[0].values = values;
+			slots[0].time = 0;
+			_states_commit(&track->states, 1);
+			_states_lines(&track->states, track->states.count - 1, 1);
+			track->lines++;
+			done++;
+			continue;
+		}
+		// the states that follow, for the same track
+		for(i=0;i<run && done+i < count && src[done+i].track == track->leds && src[done+i].state.time;i++)
+			slots[i] = src[done+i].state;
+		_states_commit(&track->states, _track_pack(track, slots, i));
+		track->bare = 0;
+		track->playable = true;
+		done += i;
 	}
-	up_read(&dev->semaphore);
-	// 3. return
-	*fpos = (loff_t)read_offset;
-	return (ssize_t)total_read;
+	// the blocks it opened are its own, until they're closed
+	if(!lcf->staging)
+		seq->writer = _sequence_open(seq) ? lcf : NULL;
+	_file_states_unlock(lcf);
+	return err;
 }
 
-static int _next_line(struct lc_states_dev *dev, char *newline, int part_size)
+/* the file's states were cut short, by the memory (or its budget) */
+static void _file_states_lost(struct lc_file *lcf, int err)
 {
-	char *prev = dev->partial;
-	int new_size = dev->partial_len - part_size;
-	if(new_size > 0)
-	{
-		dev->partial = kmalloc(new_size*sizeof(char), GFP_KERNEL);
-		if(!dev->partial)
-		{
-			dev->partial = prev;
-			up_write(&dev->semaphore);
-			mutex_unlock(&dev->partial_mx);
-			return -ENOMEM;
-		}
-		// prev is always !NULL here
-		// `newline` still points to somewhere in `prev`
-		memcpy(dev->partial, newline+1, new_size);
-	}
-	else
-		dev->partial = NULL;
-	dev->partial_len = new_size;
-	if(prev)
-		kfree(prev);
-	return 0;
+	if(err == -ENOMEM || err == -ENOSPC)
+		lcf->lost = true;
+}
+
+/*
+	Start playing appended states, if it isn't already,
+	or the tracks that were `started` while playing
+*/
+static void _states_kick(struct lc_file *lcf, bool started)
+{
+	if(!lcf->staging && (started || !READ_ONCE(lcf->dev->running)))
+		_channel_signal(lcf->dev, CSIGNAL_STA);
 }
 
 static ssize_t lc_states_write(struct file *filp, const char __user *buf, size_t count, loff_t *fpos)
 {
 	/* we ignore `fpos`, we only allow append */
-	ssize_t retval = -ENOMEM;
-	char *newline;
-	int all_set, i;
-	struct lc_states_dev *dev = (struct lc_states_dev*)filp->private_data;
+	ssize_t retval = 0;
+	int err = 0, append_err;
+	size_t to_copy, consumed;
+	unsigned parsed;
+	bool started = false;
+	struct lc_file *lcf = _file_data(filp);
+	struct lc_states_dev *dev = lcf->dev;
 	/* don't allow writes if all pins are not set */
-	down_read(&dev->leds->rw_semaphore);
-	all_set = 1;
-	for(i=0;i<dev->leds->led_count;i++)
-	{
-		if(!dev->leds->leds[i]->gpio)
-			all_set = 0;
-	}
-	up_read(&dev->leds->rw_semaphore);
-	if(!all_set)
-	{
-		printk(KERN_WARNING "ledcontroller: attempt to write before all pins are set\n");
+	if(!_leds_all_set(dev))
 		return -ENXIO;
-	}
 
 
-	if(mutex_lock_interruptible(&dev->partial_mx))
+	if(mutex_lock_interruptible(&lcf->write_mx))
 		return -EINTR;
 
+	if((!lcf->partial && !(lcf->partial = kmalloc(LC_PARTIAL_SIZE, GFP_KERNEL)))
+		|| (!lcf->batch && !(lcf->batch = kmalloc_array(LC_BATCH_STATES, sizeof(struct lc_event), GFP_KERNEL))))
+	{
+		mutex_unlock(&lcf->write_mx);
+		return -ENOMEM;
+	}
 
-	{ /* append to buffer */
-		char *prev = dev->partial;
-		// recreate with bigger size
-		dev->partial = (char*)kmalloc((dev->partial_len+count)*sizeof(char), GFP_KERNEL);
-		if(!dev->partial)
+	while(retval < count)
+	{
+		/* append to buffer */
+		to_copy = min_t(size_t, count - retval, LC_PARTIAL_SIZE - lcf->partial_len);
+		if(copy_from_user(lcf->partial + lcf->partial_len, buf + retval, to_copy))
 		{
-			// reset
-			dev->partial = prev;
-			mutex_unlock(&dev->partial_mx);
-			return -ENOMEM;
+			err = -EFAULT;
+			break;
 		}
-		// copy from previous
-		if(prev)
+		lcf->partial_len += to_copy;
+		retval += to_copy;
+
+		/* parse the lines in this buffer, and append them, a batch at a time */
+		do
+		{
+			err = _parse_lines(lcf, &consumed, &parsed);
+			/* keep the incomplete line for the next round */
+			lcf->partial_len -= consumed;
+			memmove(lcf->partial, lcf->partial + consumed, lcf->partial_len);
+			// the lines before an invalid one still count
+			if((append_err = _file_states_append(lcf, lcf->batch, parsed, &started)))
+			{
+				_file_states_lost(lcf, append_err);
+				err = append_err;
+			}
+		} while(!err && parsed == LC_BATCH_STATES);
+		if(err)
+			break;
+		if(lcf->partial_len == LC_PARTIAL_SIZE)
 		{
-			memcpy(dev->partial, prev, dev->partial_len);
-			kfree(prev);
+			// a full buffer with no newline, it can't be a valid line
+			printk_ratelimited(KERN_DEBUG "ledcontroller: dropping oversized line\n");
+			lcf->partial_len = 0;
+			err = -EINVAL;
+			break;
 		}
-
-		/*
-			we don't retry copies.
-			worse case scenario the partial buffer will have unused space
-			at the end, but it will be freed on a new write or at the end,
-			since we don't use the actual size of the buffer for re-sizes
-			but the string length
-		*/
-		retval = count - copy_from_user(dev->partial+dev->partial_len, buf, count);
-		dev->partial_len += retval;
 	}
 
-	// check for '\n'(s)
-	down_write(&dev->semaphore);
-	while((newline = memchr(dev->partial, '\n', dev->partial_len)))
+	_states_kick(lcf, started);
+	mutex_unlock(&lcf->write_mx);
+
+	return err ? err : retval;
+}
+
+/*
+	Binary bulk append: states are copied from userspace straight into
+	the table, a chunk at a time, and only validated there
+*/
+static long _states_append(struct lc_file *lcf, struct ledc_append __user *uarg)
+{
+	struct lc_states_dev *dev = lcf->dev;
+	struct ledc_append arg;
+	const struct ledc_state __user *src;
+	struct lc_sequence *seq;
+	struct lc_track *track;
+	struct lc_state *slots;
+	unsigned run, i, done = 0;
+	u32 valid_mask;
+	long err = 0;
+
+	/* the binary format is the same as ours */
+	BUILD_BUG_ON(sizeof(struct ledc_state) != sizeof(struct lc_state));
+	BUILD_BUG_ON(offsetof(struct ledc_state, values) != offsetof(struct lc_state, values));
+	BUILD_BUG_ON(offsetof(struct ledc_state, time) != offsetof(struct lc_state, time));
+
+	if(copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if(!_leds_all_set(dev))
+		return -ENXIO;
+	src = u64_to_user_ptr(arg.states);
+	valid_mask = _channel_leds(dev);
+
+	while(done < arg.count && !err)
 	{
-		char *it;
-		int i, offset, part_size;
-		struct ll_node *node;
-		part_size = newline + 1 - dev->partial;
-		if(newline == dev->partial)
+		if(IS_ERR(seq = _file_states_lock(lcf)))
 		{
-			// empty line, ignore it
-			goto _next_line_tag;
+			err = PTR_ERR(seq);
+			break;
 		}
-		node = (struct ll_node*)kmalloc(sizeof(struct ll_node), GFP_KERNEL);
-		if(!node)
+		// frames only
+		track = _sequence_track(seq, LC_TRACK_FRAMES);
+		if(IS_ERR(track) || IS_ERR(slots = _states_reserve_run(&track->states, &run)))
 		{
-			up_write(&dev->semaphore);
-			mutex_unlock(&dev->partial_mx);
-			return -ENOMEM;
+			_file_states_unlock(lcf);
+			err = IS_ERR(track) ? PTR_ERR(track) : PTR_ERR(slots);
+			_file_states_lost(lcf, err);
+			break;
 		}
-		memset(node, 0, sizeof(struct ll_node));
-		node->repr_size = part_size;
-		node->led_values = kmalloc(sizeof(unsigned char)*dev->leds->led_count, GFP_KERNEL);
-		if(!node->led_values)
+		run = min(run, arg.count - done);
+		if(copy_from_user(slots, src + done, run * sizeof(struct lc_state)))
 		{
-			kfree(node);
-			up_write(&dev->semaphore);
-			mutex_unlock(&dev->partial_mx);
-			return -ENOMEM;
+			err = -EFAULT;
+			run = 0;
 		}
-		// now parse from input (leds)
-		for(i=0, offset=0, it=dev->partial;i<dev->leds->led_count;i++)
+		// only the valid ones (up to the first invalid) count
+		for(i=0;i<run;i++)
 		{
-			int err;
-			char *comma = memchr(it, ',', part_size-offset);
-			if(!comma || comma > newline)
+			if(!slots[i].time || (slots[i].values & ~valid_mask))
 			{
-				// invalid
-				kfree(node->led_values);
-				kfree(node);
-				// remove this line
-				_next_line(dev, newline, part_size);
-				up_write(&dev->semaphore);
-				mutex_unlock(&dev->partial_mx);
-				return -EINVAL;
-			}
-			offset += comma+1-it;
-			*comma = 0;	// set NULL byte
-			// parse
-			err = kstrtos8(it, 10, node->led_values+i);
-			if(err == -ERANGE || err == -EINVAL)
-			{
-				// invalid
-				kfree(node->led_values);
-				kfree(node);
-				// remove this line
-				_next_line(dev, newline, part_size);
-				up_write(&dev->semaphore);
-				mutex_unlock(&dev->partial_mx);
-				return -EINVAL;
+				err = -EINVAL;
+				break;
 			}
-			// next item
-			it = comma +1;
 		}
-		// parse time value
+		_states_commit(&track->states, _track_pack(track, slots, i));
+		if(i)
 		{
-			// `it` should be at the sweet spot
-			int err;
-			// set null byte
-			*newline = 0;
-			// parse
-			err = kstrtou32(it, 10, &node->time);
-			if(err == -ERANGE || err == -EINVAL || node->time < 1)
-			{
-				// invalid
-				kfree(node->led_values);
-				kfree(node);
-				// remove this line
-				_next_line(dev, newline, part_size);
-				up_write(&dev->semaphore);
-				mutex_unlock(&dev->partial_mx);
-				return -EINVAL;
-			}
+			track->bare = 0;
+			track->playable = true;
+		}
+		_file_states_unlock(lcf);
+		done += i;
+	}
+
+	_states_kick(lcf, false);
+	return done ? done : err;
+}
+
+/* the most states an edit inserts, more are appended */
+#define LC_EDIT_MAX (LC_CHUNK_STATES * 128)
+
+/*
+	Edit a track: the new states are copied in first, then the track is
+	edited in one go, under the lock, so playback (and reads) see it all
+	at once
+*/
+static long _states_edit(struct lc_file *lcf, struct ledc_edit __user *uarg)
+{
+	struct lc_states_dev *dev = lcf->dev;
+	struct ledc_edit arg;
+	struct lc_sequence *seq;
+	struct lc_track *track;
+	struct lc_state *src = NULL;
+	bool started;
+	u32 valid_mask;
+	long err = 0;
+	unsigned i;
+
+	if(copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+	if(arg.count > LC_EDIT_MAX)
+		return -EINVAL;
+	// events are for a range of the channel's leds
+	if(arg.leds && ((arg.leds & ~_channel_leds(dev)) || arg.leds != GENMASK(__fls(arg.leds), __ffs(arg.leds))))
+		return -EINVAL;
+	if(!_leds_all_set(dev))
+		return -ENXIO;
+	if(arg.count && !(src = kvmalloc_array(arg.count, sizeof(struct lc_state), GFP_KERNEL)))
+		return -ENOMEM;
+	if(copy_from_user(src, u64_to_user_ptr(arg.states), arg.count * sizeof(struct lc_state)))
+	{
+		err = -EFAULT;
+		goto _out;
+	}
+
+	if(IS_ERR(seq = _file_states_lock(lcf)))
+	{
+		err = PTR_ERR(seq);
+		goto _out;
+	}
+	// only the tracks there are, an edit doesn't add any
+	if(!(track = _sequence_track_find(seq, arg.leds ? arg.leds : LC_TRACK_FRAMES)))
+		err = -EINVAL;
+	else
+	{
+		valid_mask = track->leds == LC_TRACK_FRAMES ? _channel_leds(dev) : track->leds;
+		for(i=0;i<arg.count;i++)
+		{
+			if(!src[i].time || (src[i].values & ~valid_mask))
+				err = -EINVAL;
 		}
+		started = !track->states.count;
+		if(!err)
+			err = _track_edit(track, arg.index, arg.remove, src, arg.count);
+		started = started && track->states.count;
+		// readers go through it again
+		if(!err && !lcf->staging)
+			dev->commits++;
+	}
+	_file_states_unlock(lcf);
+	// a failed edit changed nothing, there's nothing lost
+	if(!err)
+		_states_kick(lcf, started);
+_out:
+	kvfree(src);
+	return err;
+}
+
+/*
+	Playback controls, from the ioctls and sysfs alike, applied by the runner
+*/
+
+static void _control_pause(struct lc_states_dev *dev, bool pause)
+{
+	WRITE_ONCE(dev->pause, pause);
+	_runner_signal(TSIGNAL_CNT);
+}
+
+/* the lines the sub-patterns read back as, they're before the tracks */
+static unsigned _sequence_subs_lines(struct lc_sequence *seq)
+{
+	unsigned i, lines = 0;
+	for(i=0;i<seq->subs_len;i++)
+	{
+		// the one being defined has no `enddef` yet
+		lines += seq->subs[i].track.lines + (seq->defining == (int)i ? 1 : 2);
+	}
+	return lines;
+}
+
+/*
+	To line `line` of the states, as they read back, it has to be in the
+	frames (not in a track of its own leds, even if it comes first)
+*/
+static int _control_seek(struct lc_states_dev *dev, unsigned line)
+{
+	struct lc_seek seek = { 0 };
+	struct lc_track *track;
+	unsigned subs;
+	down_read(&dev->semaphore);
+	track = _sequence_track_find(dev->seq, LC_TRACK_FRAMES);
+	subs = _sequence_subs_lines(dev->seq);
+	if(track && line >= subs && line - subs < track->lines)
+	{
+		seek.seq = dev->seq;
+		seek.track = track - dev->seq->tracks;
+		seek.index = _states_line(&track->states, line - subs, &seek.rep);
+		seek.edits = _states_table(&track->states)->edits;
+	}
+	up_read(&dev->semaphore);
+	if(!seek.seq)
+		return -EINVAL;
+	spin_lock(&dev->seek_lock);
+	dev->seek = seek;
+	spin_unlock(&dev->seek_lock);
+	_channel_signal(dev, CSIGNAL_SEEK);
+	return 0;
+}
+
+/* from the next state on */
+static int _control_rate(struct lc_states_dev *dev, unsigned rate)
+{
+	if(!rate || rate > LC_RATE_MAX)
+		return -EINVAL;
+	WRITE_ONCE(dev->rate, rate);
+	return 0;
+}
+
+/* a channel that played all of them starts over */
+static void _control_loops(struct lc_states_dev *dev, unsigned loops)
+{
+	WRITE_ONCE(dev->loops, loops);
+	_channel_signal(dev, CSIGNAL_STA);
+}
+
+static long _control_ioctl(struct lc_states_dev *dev, unsigned int cmd, unsigned long arg)
+{
+	__u32 value = 0;
+	if(_IOC_DIR(cmd) & _IOC_WRITE)
+	{
+		if(get_user(value, (__u32 __user *)arg))
+			return -EFAULT;
+	}
+	switch(cmd)
+	{
+		case LEDC_IOC_PAUSE:
+		case LEDC_IOC_RESUME:
+			_control_pause(dev, cmd == LEDC_IOC_PAUSE);
+			return 0;
+		case LEDC_IOC_SEEK:
+			return _control_seek(dev, value);
+		case LEDC_IOC_RATE:
+			return _control_rate(dev, value);
+		case LEDC_IOC_LOOPS:
+			_control_loops(dev, value);
+			return 0;
+	}
+	return -ENOTTY;
+}
+
+/*
+	Events, read instead of the states
+*/
+
+/* from the next one the runner writes on */
+static void _events_listen(struct lc_file *lcf)
+{
+	struct lc_states_dev *dev = lcf->dev;
+	unsigned long flags;
+	raw_spin_lock_irqsave(&dev->events_lock, flags);
+	if(!lcf->events)
+	{
+		lcf->events_pos = dev->events_head;
+		WRITE_ONCE(lcf->events, true);
+		atomic_inc(&dev->listeners);
+	}
+	raw_spin_unlock_irqrestore(&dev->events_lock, flags);
+}
+
+static bool _events_pending(struct lc_file *lcf)
+{
+	unsigned long flags;
+	bool pending;
+	// `events_head` may not be read in one go
+	raw_spin_lock_irqsave(&lcf->dev->events_lock, flags);
+	pending = lcf->dev->events_head != lcf->events_pos;
+	raw_spin_unlock_irqrestore(&lcf->dev->events_lock, flags);
+	return pending;
+}
+
+/* the next event for the file, false if there's none */
+static bool _events_next(struct lc_file *lcf, struct ledc_event *ev)
+{
+	struct lc_states_dev *dev = lcf->dev;
+	unsigned long flags;
+	u64 behind;
+	raw_spin_lock_irqsave(&dev->events_lock, flags);
+	behind = dev->events_head - lcf->events_pos;
+	if(behind > LC_EVENTS_MAX)
+	{
+		// the oldest were written over
+		*ev = (struct ledc_event){
+			.time = ktime_to_ns(ktime_get()),
+			.reason = LEDC_EVENT_LOST,
+			.index = min_t(u64, behind - LC_EVENTS_MAX, UINT_MAX)
+		};
+		lcf->events_pos = dev->events_head - LC_EVENTS_MAX;
+	}
+	else if(behind)
+		*ev = dev->events[lcf->events_pos++ & (LC_EVENTS_MAX - 1)];
+	raw_spin_unlock_irqrestore(&dev->events_lock, flags);
+	return behind;
+}
+
+/* whole records only, as many as there are, waiting for one if `block` */
+static ssize_t _events_read(struct lc_file *lcf, struct iov_iter *to, bool block)
+{
+	struct ledc_event ev;
+	size_t done = 0;
+	int ret;
+	if(iov_iter_count(to) < sizeof(struct ledc_event))
+		return -EINVAL;
+	if(block && (ret = wait_event_interruptible(lcf->dev->events_wq, _events_pending(lcf))))
+		return ret;
+	while(iov_iter_count(to) >= sizeof(struct ledc_event) && _events_next(lcf, &ev))
+	{
+		if(copy_to_iter(&ev, sizeof(struct ledc_event), to) != sizeof(struct ledc_event))
+			return done ? done : -EFAULT;
+		done += sizeof(struct ledc_event);
+	}
+	return done ? done : -EAGAIN;
+}
+
+/*
+	Through iterators, for read() and for splice() (sendfile() of the
+	states): the seq_file, or the events
+*/
+static ssize_t lc_states_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
+	struct lc_file *lcf = _file_data(filp);
+	if(READ_ONCE(lcf->events))
+		return _events_read(lcf, to, !(filp->f_flags & O_NONBLOCK) && !(iocb->ki_flags & IOCB_NOWAIT));
+	return seq_read_iter(iocb, to);
+}
+
+static __poll_t lc_states_poll(struct file *filp, poll_table *wait)
+{
+	struct lc_file *lcf = _file_data(filp);
+	__poll_t mask = 0;
+	if(filp->f_mode & FMODE_WRITE)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	if(!READ_ONCE(lcf->events))
+		// the states can always be read
+		return mask | EPOLLIN | EPOLLRDNORM;
+	poll_wait(filp, &lcf->dev->events_wq, wait);
+	if(_events_pending(lcf))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	return mask;
+}
 
-		// all seems good, append new state
-		if(!dev->head)
+static long lc_states_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct lc_file *lcf = _file_data(filp);
+	switch(cmd)
+	{
+		case LEDC_IOC_APPEND:
 		{
-			dev->head = dev->tail = node;
+			long ret;
+			if(!(filp->f_mode & FMODE_WRITE))
+				return -EBADF;
+			// staged states have no lock of their own
+			if(mutex_lock_interruptible(&lcf->write_mx))
+				return -EINTR;
+			ret = _states_append(lcf, (struct ledc_append __user *)arg);
+			mutex_unlock(&lcf->write_mx);
+			return ret;
 		}
-		else
+		case LEDC_IOC_EDIT:
 		{
-			dev->tail->next = node;
-			dev->tail = node;
+			long ret;
+			if(!(filp->f_mode & FMODE_WRITE))
+				return -EBADF;
+			if(mutex_lock_interruptible(&lcf->write_mx))
+				return -EINTR;
+			ret = _states_edit(lcf, (struct ledc_edit __user *)arg);
+			mutex_unlock(&lcf->write_mx);
+			return ret;
 		}
-
-		// remove part of the buffer
-	_next_line_tag:
-		if(_next_line(dev, newline, part_size))
-			return -ENOMEM;
-	}
-	downgrade_write(&dev->semaphore);
-	if(dev->head && !hrtimer_active(&states_hrtimer))
-	{
-		printk(KERN_DEBUG "ledcontroller: initializing timer\n");
-		timer_signal = TSIGNAL_CNT;
-		wake_up(&wq);
+		case LEDC_IOC_PAUSE:
+		case LEDC_IOC_RESUME:
+		case LEDC_IOC_SEEK:
+		case LEDC_IOC_RATE:
+		case LEDC_IOC_LOOPS:
+			if(!(filp->f_mode & FMODE_WRITE))
+				return -EBADF;
+			return _control_ioctl(lcf->dev, cmd, arg);
+		case LEDC_IOC_EVENTS:
+			_events_listen(lcf);
+			return 0;
 	}
-	up_read(&dev->semaphore);
-	mutex_unlock(&dev->partial_mx);
-
-	return retval;
+	return -ENOTTY;
 }
 
 struct file_operations lc_states_fops = {
 	.owner   = THIS_MODULE,
-	.read    = lc_states_read,
+	.read_iter   = lc_states_read_iter,
+	.splice_read = generic_file_splice_read,
+	.llseek  = seq_lseek,
 	.write   = lc_states_write,
+	.poll    = lc_states_poll,
+	.unlocked_ioctl = lc_states_ioctl,
+	.compat_ioctl   = compat_ptr_ioctl,
 	.open    = lc_states_open,
 	.release = lc_states_release
 };
@@ -459,7 +2838,7 @@ struct file_operations lc_states_fops = {
 static int lc_states_dev_setup(struct lc_states_dev *dev)
 {
 	int err;
-	int devno = MKDEV(lc_dev_major, lc_dev_minor);
+	int devno = MKDEV(lc_dev_major, lc_dev_minor + dev->index);
 
 	cdev_init(&dev->cdev, &lc_states_fops);
 	dev->cdev.owner = THIS_MODULE;
@@ -524,15 +2903,9 @@ static ssize_t store_attr(struct kobject *kobj, struct attribute *attr, const ch
 	struct led *led = container_of(kobj, struct led, kobj);
 	/* TODO: ensure attr->name == "pin" (only 1 attribute, so far) */
 
-	/* ensure states linked-list is empty */
-	down_read(&lc_states_dev.semaphore);
-	if(lc_states_dev.head)
-	{
-		// not empty
-		up_read(&lc_states_dev.semaphore);
+	/* ensure states table is empty */
+	if(_channels_busy())
 		return -EBUSY;
-	}
-	up_read(&lc_states_dev.semaphore);
 
 	printk(KERN_DEBUG "ledcontroller: store attr 'led'\n");
 	if((ret = kstrtos16(buffer, 10, &pin_number)) != 0)
@@ -579,6 +2952,15 @@ static ssize_t store_attr(struct kobject *kobj, struct attribute *attr, const ch
 	{
 		led->gpio = NULL;
 	}
+	// hand the new GPIOs to the runner, it's done with the previous one after this
+	if((ret = _leds_publish(container_of(kobj->parent, struct leds, kobj))))
+	{
+		if(led->gpio)
+			gpio_free((unsigned)pin_number);
+		led->gpio = prev;
+		up_write(&led->pin_number_sem);
+		return ret;
+	}
 	// release previous desc
 	if(prev)
 	{
@@ -621,17 +3003,12 @@ static int num_leds_set(const char *val, const struct kernel_param *kp)
 	struct leds *leds = (struct leds*)kp->arg;
 	int count_new;
 
-	// check if states linked-list has values, if !empty, return some error
+	// check if states table has values, if !empty, return some error
 	if(leds->led_count >= 0)
 	{
 		// we only check if it is already initialized
-		down_read(&lc_states_dev.semaphore);
-		if(lc_states_dev.head)
-		{
-			up_read(&lc_states_dev.semaphore);
+		if(_channels_busy())
 			return -EBUSY;
-		}
-		up_read(&lc_states_dev.semaphore);
 	}
 
 
@@ -714,7 +3091,7 @@ static int _update_led_count(struct leds *leds, int count_new)
 				up_write(&leds->rw_semaphore);
 				return ret;
 			}
-			leds->leds[i] = led;
+			leds->leds[pin_number] = led;
 			/* do each iteration as it can fail anytime */
 			leds->led_count++;
 		}
@@ -722,8 +3099,16 @@ static int _update_led_count(struct leds *leds, int count_new)
 	else if(count_diff < 0)
 	{
 		// remove objects
-		int i;
+		int i, ret;
 		printk(KERN_DEBUG "ledcontroller: deleting %d leds\n", -count_diff);
+		// the runner must be done with their GPIOs first
+		leds->led_count = count_new;
+		if((ret = _leds_publish(leds)))
+		{
+			leds->led_count = count_current;
+			up_write(&leds->rw_semaphore);
+			return ret;
+		}
 		for(i=count_new;i<count_current;i++)
 		{
 			struct kobject *kobj = &leds->leds[i]->kobj;
@@ -731,11 +3116,13 @@ static int _update_led_count(struct leds *leds, int count_new)
 			kobject_put(kobj);
 			leds->leds[i] = NULL;
 		}
-		leds->led_count = count_new;
 	}
 	up_write(&leds->rw_semaphore);
 	// else, count_diff == 0, no changes
 
+	// new leds have no GPIO yet, only the count changes
+	if(count_diff > 0)
+		return _leds_publish(leds);
 	return 0;
 }
 
@@ -760,6 +3147,7 @@ static int parent_kobj_init(void)
 	int ret;
 	kobject_init(&leds.kobj, &leds_kobj_type);
 	init_rwsem(&leds.rw_semaphore);
+	mutex_init(&leds.outputs_mx);
 
 	if((ret = kobject_set_name(&leds.kobj, "leds")))
 		goto _fail_1;
@@ -775,6 +3163,400 @@ _fail_1:
 	return ret;
 }
 
+/*
+	Channel kobjects, for runtime information,
+	channel 0 is also 'states' (as it was the only one)
+*/
+
+static struct kobject *channels_kobj;
+/* serializes changing the channels' leds */
+static DEFINE_MUTEX(channels_mx);
+
+static void states_kobj_release(struct kobject *kobj)
+{
+	// nothing done here, it's statically allocated
+	printk(KERN_DEBUG "ledcontroller: releasing states kobject\n");
+}
+
+static ssize_t output_path_show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	// the one in use (for all of the channels), as the runner last set it
+	return sprintf(buffer, "%s\n", READ_ONCE(runner_direct) ? "hrtimer" : "kthread");
+}
+
+static struct kobj_attribute output_path_attr = __ATTR_RO(output_path);
+
+static const char * const commit_at_names[] = {
+	[LC_COMMIT_NOW]   = "now",
+	[LC_COMMIT_FRAME] = "frame",
+	[LC_COMMIT_LOOP]  = "loop"
+};
+
+static ssize_t commit_show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct lc_states_dev *dev = container_of(kobj, struct lc_states_dev, kobj);
+	return sprintf(buffer, "%s\n", commit_at_names[READ_ONCE(dev->commit_at)]);
+}
+
+static ssize_t commit_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct lc_states_dev *dev = container_of(kobj, struct lc_states_dev, kobj);
+	int commit_at = sysfs_match_string(commit_at_names, buffer);
+	if(commit_at < 0)
+		return commit_at;
+	WRITE_ONCE(dev->commit_at, commit_at);
+	return count;
+}
+
+static struct kobj_attribute commit_attr = __ATTR_RW(commit);
+
+/* the channel's leds, as a list (`0-3,5`) */
+static ssize_t leds_show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct lc_states_dev *dev = container_of(kobj, struct lc_states_dev, kobj);
+	unsigned long mask = READ_ONCE(dev->leds_mask);
+	return bitmap_print_to_pagebuf(true, buffer, &mask, LEDS_MAX);
+}
+
+static ssize_t leds_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct lc_states_dev *dev = container_of(kobj, struct lc_states_dev, kobj);
+	unsigned long mask;
+	int ret, i;
+	if((ret = bitmap_parselist(buffer, &mask, LEDS_MAX)))
+		return ret;
+	mutex_lock(&channels_mx);
+	// a led can only be played by one channel
+	for(i=0;i<lc_channels;i++)
+	{
+		if(i != dev->index && (lc_states_devs[i].leds_mask & mask))
+			ret = -EINVAL;
+	}
+	// its states (if any) are for the leds it has
+	if(!ret && _states_busy(dev))
+		ret = -EBUSY;
+	if(!ret)
+		WRITE_ONCE(dev->leds_mask, mask);
+	mutex_unlock(&channels_mx);
+	return ret ? ret : count;
+}
+
+static struct kobj_attribute leds_attr = __ATTR_RW(leds);
+
+/*
+	The library: the channel's current states are saved under a name
+	(`save`), to be played again later (`play`) without uploading them,
+	by committing them as they are. Saved states don't change, appends
+	go to a copy of them, uploads replace them as usual
+*/
+
+/* a name from sysfs, without the newline */
+static int _saved_name(const char *buffer, char name[LC_NAME_MAX])
+{
+	size_t len = strcspn(buffer, "\n");
+	if(!len || len >= LC_NAME_MAX || memchr(buffer, ' ', len))
+		return -EINVAL;
+	memcpy(name, buffer, len);
+	name[len] = 0;
+	return 0;
+}
+
+/* the library entry called `name` (a free one for ""), under the semaphore */
+static struct lc_saved *_library_find(struct lc_states_dev *dev, const char *name)
+{
+	int i;
+	for(i=0;i<LC_LIBRARY_MAX;i++)
+	{
+		if(!strcmp(dev->library[i].name, name))
+			return &dev->library[i];
+	}
+	return NULL;
+}
+
+static ssize_t library_show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct lc_states_dev *dev = container_of(kobj, struct lc_states_dev, kobj);
+	int i, offset = 0;
+	down_read(&dev->semaphore);
+	for(i=0;i<LC_LIBRARY_MAX;i++)
+	{
+		if(dev->library[i].seq)
+			offset += sprintf(buffer+offset, "%s\n", dev->library[i].name);
+	}
+	up_read(&dev->semaphore);
+	return offset;
+}
+
+static struct kobj_attribute library_attr = __ATTR_RO(library);
+
+static ssize_t save_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct lc_states_dev *dev = container_of(kobj, struct lc_states_dev, kobj);
+	struct lc_sequence *prev = NULL;
+	char name[LC_NAME_MAX];
+	struct lc_saved *saved;
+	int ret;
+	if((ret = _saved_name(buffer, name)))
+		return ret;
+	down_write(&dev->semaphore);
+	// saving again under the same name replaces it
+	if(!(saved = _library_find(dev, name)))
+		saved = _library_find(dev, "");
+	if(saved)
+	{
+		prev = saved->seq;
+		strscpy(saved->name, name, LC_NAME_MAX);
+		dev->seq->saved = true;
+		refcount_inc(&dev->seq->refs);
+		saved->seq = dev->seq;
+	}
+	up_write(&dev->semaphore);
+	_sequence_put(prev);
+	return saved ? count : -ENOSPC;
+}
+
+static struct kobj_attribute save_attr = __ATTR_WO(save);
+
+/* the saved states that are current, if any */
+static ssize_t play_show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct lc_states_dev *dev = container_of(kobj, struct lc_states_dev, kobj);
+	int i, offset = 0;
+	down_read(&dev->semaphore);
+	for(i=0;i<LC_LIBRARY_MAX && !offset;i++)
+	{
+		if(dev->library[i].seq && dev->library[i].seq == dev->seq)
+			offset = sprintf(buffer, "%s\n", dev->library[i].name);
+	}
+	up_read(&dev->semaphore);
+	return offset;
+}
+
+/* switching is just a commit, the states are already there */
+static ssize_t play_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct lc_states_dev *dev = container_of(kobj, struct lc_states_dev, kobj);
+	struct lc_sequence *seq = NULL;
+	char name[LC_NAME_MAX];
+	struct lc_saved *saved;
+	int ret;
+	if((ret = _saved_name(buffer, name)))
+		return ret;
+	down_read(&dev->semaphore);
+	if((saved = _library_find(dev, name)))
+	{
+		seq = saved->seq;
+		// the channel's reference
+		refcount_inc(&seq->refs);
+	}
+	up_read(&dev->semaphore);
+	if(!seq)
+		return -ENOENT;
+	_sequence_commit(dev, seq);
+	return count;
+}
+
+static struct kobj_attribute play_attr = __ATTR_RW(play);
+
+static ssize_t delete_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct lc_states_dev *dev = container_of(kobj, struct lc_states_dev, kobj);
+	struct lc_sequence *seq = NULL;
+	char name[LC_NAME_MAX];
+	struct lc_saved *saved;
+	int ret;
+	if((ret = _saved_name(buffer, name)))
+		return ret;
+	down_write(&dev->semaphore);
+	if((saved = _library_find(dev, name)))
+	{
+		seq = saved->seq;
+		memset(saved, 0, sizeof(struct lc_saved));
+	}
+	up_write(&dev->semaphore);
+	if(!seq)
+		return -ENOENT;
+	// it's still played, if it's current
+	_sequence_put(seq);
+	return count;
+}
+
+static struct kobj_attribute delete_attr = __ATTR_WO(delete);
+
+/* playback controls, as the ioctls */
+static ssize_t paused_show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct lc_states_dev *dev = container_of(kobj, struct lc_states_dev, kobj);
+	return sprintf(buffer, "%d\n", READ_ONCE(dev->pause));
+}
+
+static ssize_t paused_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct lc_states_dev *dev = container_of(kobj, struct lc_states_dev, kobj);
+	bool pause;
+	int ret;
+	if((ret = kstrtobool(buffer, &pause)))
+		return ret;
+	_control_pause(dev, pause);
+	return count;
+}
+
+static struct kobj_attribute paused_attr = __ATTR_RW(paused);
+
+static ssize_t seek_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct lc_states_dev *dev = container_of(kobj, struct lc_states_dev, kobj);
+	unsigned line;
+	int ret;
+	if((ret = kstrtouint(buffer, 10, &line)))
+		return ret;
+	if((ret = _control_seek(dev, line)))
+		return ret;
+	return count;
+}
+
+static struct kobj_attribute seek_attr = __ATTR_WO(seek);
+
+static ssize_t rate_show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct lc_states_dev *dev = container_of(kobj, struct lc_states_dev, kobj);
+	return sprintf(buffer, "%u\n", READ_ONCE(dev->rate));
+}
+
+static ssize_t rate_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct lc_states_dev *dev = container_of(kobj, struct lc_states_dev, kobj);
+	unsigned rate;
+	int ret;
+	if((ret = kstrtouint(buffer, 10, &rate)))
+		return ret;
+	if((ret = _control_rate(dev, rate)))
+		return ret;
+	return count;
+}
+
+static struct kobj_attribute rate_attr = __ATTR_RW(rate);
+
+static ssize_t loops_show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	struct lc_states_dev *dev = container_of(kobj, struct lc_states_dev, kobj);
+	return sprintf(buffer, "%u\n", READ_ONCE(dev->loops));
+}
+
+static ssize_t loops_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buffer, size_t count)
+{
+	struct lc_states_dev *dev = container_of(kobj, struct lc_states_dev, kobj);
+	unsigned loops;
+	int ret;
+	if((ret = kstrtouint(buffer, 10, &loops)))
+		return ret;
+	_control_loops(dev, loops);
+	return count;
+}
+
+static struct kobj_attribute loops_attr = __ATTR_RW(loops);
+
+static struct attribute *states_attrs[] = {
+	&output_path_attr.attr,
+	&commit_attr.attr,
+	&leds_attr.attr,
+	&library_attr.attr,
+	&save_attr.attr,
+	&play_attr.attr,
+	&delete_attr.attr,
+	&paused_attr.attr,
+	&seek_attr.attr,
+	&rate_attr.attr,
+	&loops_attr.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(states);
+
+static struct kobj_type states_kobj_type = {
+	.release = states_kobj_release,
+	.sysfs_ops = &kobj_sysfs_ops,
+	.default_groups = states_groups
+};
+
+static int states_kobj_init(struct lc_states_dev *dev)
+{
+	int ret;
+	kobject_init(&dev->kobj, &states_kobj_type);
+
+	if((ret = kobject_set_name(&dev->kobj, "%d", dev->index)))
+		goto _fail_1;
+	if((ret = kobject_add(&dev->kobj, channels_kobj, NULL)))
+		goto _fail_1;
+	if((ret = kobject_uevent(&dev->kobj, KOBJ_ADD)))
+		goto _fail_2;
+	return 0;
+_fail_2:
+	kobject_del(&dev->kobj);
+_fail_1:
+	kobject_put(&dev->kobj);
+	return ret;
+}
+
+/* memory in use by the states, of all the channels, and the most it got to */
+static struct kobject *memory_kobj;
+
+static ssize_t usage_show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	return sprintf(buffer, "%ld\n", atomic_long_read(&lc_mem_usage));
+}
+
+static struct kobj_attribute usage_attr = __ATTR_RO(usage);
+
+static ssize_t peak_show(struct kobject *kobj, struct kobj_attribute *attr, char *buffer)
+{
+	return sprintf(buffer, "%ld\n", atomic_long_read(&lc_mem_peak));
+}
+
+static struct kobj_attribute peak_attr = __ATTR_RO(peak);
+
+static struct attribute *memory_attrs[] = {
+	&usage_attr.attr,
+	&peak_attr.attr,
+	NULL
+};
+
+static const struct attribute_group memory_group = {
+	.attrs = memory_attrs
+};
+
+/*
+	debugfs: the runner's counters, and its histograms, a line per bucket
+	that's not empty (where it starts, in nanoseconds, and its count)
+*/
+static struct dentry *lc_debugfs;
+
+static int lc_hist_show(struct seq_file *m, void *v)
+{
+	struct lc_hist *hist = m->private;
+	int i;
+	seq_printf(m, "count %llu\nsum %llu\nmax %llu\n", hist->count, hist->sum, hist->max);
+	for(i=0;i<LC_HIST_BUCKETS;i++)
+	{
+		if(hist->buckets[i])
+			seq_printf(m, "%llu %llu\n", i ? 1ULL << i : 0, hist->buckets[i]);
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(lc_hist);
+
+/* nothing fails on it, the driver works the same without it */
+static void lc_debugfs_init(void)
+{
+	lc_debugfs = debugfs_create_dir("ledcontroller", NULL);
+	debugfs_create_u64("timer_fires", 0444, lc_debugfs, &lc_stats.timer_fires);
+	debugfs_create_u64("runner_wakes", 0444, lc_debugfs, &lc_stats.runner_wakes);
+	debugfs_create_u64("gpio_applies", 0444, lc_debugfs, &lc_stats.gpio_applies);
+	debugfs_create_u64("sequence_swaps", 0444, lc_debugfs, &lc_stats.sequence_swaps);
+	debugfs_create_file("wakeup_latency", 0444, lc_debugfs, &lc_stats.wakeup_latency, &lc_hist_fops);
+	debugfs_create_file("timer_lateness", 0444, lc_debugfs, &lc_stats.timer_lateness, &lc_hist_fops);
+	debugfs_create_file("gpio_apply", 0444, lc_debugfs, &lc_stats.gpio_apply, &lc_hist_fops);
+}
+
 #endif /* Module params/Kobjects */
 
 /*
@@ -783,12 +3565,78 @@ _fail_1:
 
 struct task_struct *gpio_thread;
 
-int lc_init_module(void)
+static int lc_channel_init(struct lc_states_dev *dev, int index)
 {
 	int ret, i;
+	memset(dev, 0, sizeof(struct lc_states_dev));
+	dev->index = index;
+	for(i=0;i<LEDS_MAX;i++)
+	{
+		dev->cursors[i].dev = dev;
+		dev->cursors[i].track = i;
+	}
+	// init semaphore
+	init_rwsem(&dev->semaphore);
+	dev->leds = &leds;
+	// the first channel has all the leds, to begin with
+	dev->leds_mask = index ? 0 : LEDS_MASK(LEDS_MAX);
+	// start with no states, for the runner to pick up
+	dev->seq = dev->pending = _sequence_alloc();
+	if(IS_ERR(dev->seq))
+		return PTR_ERR(dev->seq);
+	dev->commit_at = LC_COMMIT_FRAME;
+	dev->rate = LC_RATE_UNIT;
+	spin_lock_init(&dev->seek_lock);
+	raw_spin_lock_init(&dev->events_lock);
+	init_waitqueue_head(&dev->events_wq);
+	init_llist_head(&dev->retired);
+	INIT_WORK(&dev->retire_work, _sequence_retire_work);
+
+	if((ret = states_kobj_init(dev)))
+		goto _fail_1;
+	if((ret = lc_states_dev_setup(dev)))
+		goto _fail_2;
+	return 0;
+
+_fail_2:
+	kobject_del(&dev->kobj);
+	kobject_put(&dev->kobj);
+_fail_1:
+	_sequence_free(dev->seq);
+	return ret;
+}
+
+/* with the runner stopped */
+static void lc_channel_cleanup(struct lc_states_dev *dev)
+{
+	int i;
+	cdev_del(&dev->cdev);
+	kobject_del(&dev->kobj);
+	kobject_put(&dev->kobj);
+
+	/* free states, the runner is done with them */
+	flush_work(&dev->retire_work);
+	if(dev->playing != dev->seq)
+		_sequence_put(dev->playing);
+	_sequence_put(dev->seq);
+	for(i=0;i<LC_LIBRARY_MAX;i++)
+		_sequence_put(dev->library[i].seq);
+}
+
+int lc_init_module(void)
+{
+	int ret, i, ch = 0;
 	dev_t dev = 0;
 	printk(KERN_DEBUG "hello from led-controller module!\n");
 
+	if(lc_channels < 1 || lc_channels > LC_CHANNELS_MAX)
+	{
+		printk(KERN_ERR "ledcontroller: channels must be 1-%d\n", LC_CHANNELS_MAX);
+		return -EINVAL;
+	}
+	if(!(lc_chunk_cache = kmem_cache_create("ledc_states", LC_CHUNK_BYTES, 0, 0, NULL)))
+		return -ENOMEM;
+
 	{ /* params/leds init */
 		if((ret = parent_kobj_init()))
 			goto _fail_0;
@@ -796,6 +3644,9 @@ int lc_init_module(void)
 		if(leds.led_count < 0)
 		{
 			leds.led_count = 0;
+			// no leds, no GPIOs, the runner still needs the (empty) set
+			if((ret = _leds_publish(&leds)))
+				goto _fail_1;
 		}
 		else
 		{
@@ -808,39 +3659,57 @@ int lc_init_module(void)
 	}
 
 	{ /* cdev init */
-		ret = alloc_chrdev_region(&dev, lc_dev_minor, LC_MINOR_COUNT, "ledcontroller");
+		ret = alloc_chrdev_region(&dev, lc_dev_minor, lc_channels, "ledcontroller");
 		lc_dev_major = MAJOR(dev);
 		if(ret < 0)
 		{
 			printk(KERN_ERR "ledcontroller: can't get major for device: %d\n", ret);
 			goto _fail_1;
 		}
-		memset(&lc_states_dev, 0, sizeof(lc_states_dev));
-		// init semaphores
-		init_rwsem(&lc_states_dev.semaphore);
-		mutex_init(&lc_states_dev.partial_mx);
-		lc_states_dev.leds = &leds;
-
-		ret = lc_states_dev_setup(&lc_states_dev);
-		if(ret)
+		if(!(channels_kobj = kobject_create_and_add("channels", &THIS_MODULE->mkobj.kobj)))
+		{
+			ret = -ENOMEM;
 			goto _fail_2;
+		}
+		if(!(memory_kobj = kobject_create_and_add("memory", &THIS_MODULE->mkobj.kobj)))
+		{
+			ret = -ENOMEM;
+			goto _fail_3;
+		}
+		if((ret = sysfs_create_group(memory_kobj, &memory_group)))
+			goto _fail_3;
+		for(ch=0;ch<lc_channels;ch++)
+		{
+			if((ret = lc_channel_init(&lc_states_devs[ch], ch)))
+				goto _fail_3;
+		}
 	}
 
-	hrtimer_init(&states_hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	if((ret = sysfs_create_link(&THIS_MODULE->mkobj.kobj, &lc_states_devs[0].kobj, "states")))
+		goto _fail_3;
+
+	hrtimer_init(&states_hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
 	states_hrtimer.function = _states_hrtimer_callback;
 
-	if((gpio_thread = kthread_run(_thread_gpio_runner, &lc_states_dev, "ledc-gpio-runner")) == ERR_PTR(-ENOMEM))
+	if((gpio_thread = kthread_run(_thread_gpio_runner, NULL, "ledc-gpio-runner")) == ERR_PTR(-ENOMEM))
 	{
 		ret = -ENOMEM;
-		goto _fail_3;
+		goto _fail_4;
 	}
+	lc_debugfs_init();
 
 	return 0;
 
-_fail_3:
+_fail_4:
 	hrtimer_cancel(&states_hrtimer);
+	sysfs_remove_link(&THIS_MODULE->mkobj.kobj, "states");
+_fail_3:
+	while(ch--)
+		lc_channel_cleanup(&lc_states_devs[ch]);
+	kobject_put(memory_kobj);
+	kobject_put(channels_kobj);
 _fail_2:
-	unregister_chrdev_region(dev, LC_MINOR_COUNT);
+	unregister_chrdev_region(dev, lc_channels);
 _fail_1:
 	/* delete already created LEDs */
 	for(i=0;i<leds.led_count;i++)
@@ -848,10 +3717,12 @@ _fail_1:
 		kobject_del(&leds.leds[i]->kobj);
 		kobject_put(&leds.leds[i]->kobj);
 	}
+	kfree(rcu_dereference_protected(leds.outputs, 1));
 	/* and the parent kobject */
 	kobject_del(&leds.kobj);
 	kobject_put(&leds.kobj);
 _fail_0:
+	kmem_cache_destroy(lc_chunk_cache);
 	return ret;
 }
 
@@ -860,7 +3731,8 @@ void lc_exit_module(void)
 	int i;
 	struct kobject *kobj;
 	dev_t devno;
-	struct lc_states_dev *dev = &lc_states_dev;	// minify
+
+	debugfs_remove_recursive(lc_debugfs);
 
 	// stop timer
 	hrtimer_cancel(&states_hrtimer);
@@ -870,24 +3742,20 @@ void lc_exit_module(void)
 	}
 
 	printk(KERN_DEBUG "ledcontroller: signalling thread to exit\n");
-	timer_signal = TSIGNAL_EXT;
-	wake_up(&wq);
+	_runner_signal(TSIGNAL_EXT);
 	kthread_stop(gpio_thread);
 
-	/* free linked-list */
-	for(dev->cur=dev->head;dev->cur;dev->cur=dev->head)
-	{
-		dev->head = dev->cur->next;
-		kfree(dev->cur->led_values);
-		kfree(dev->cur);
-	}
-	if(dev->partial)
-		kfree(dev->partial);
+	sysfs_remove_link(&THIS_MODULE->mkobj.kobj, "states");
+	for(i=0;i<lc_channels;i++)
+		lc_channel_cleanup(&lc_states_devs[i]);
+	kobject_put(memory_kobj);
+	kobject_put(channels_kobj);
+	// all the states are freed, and their memory with them (edits' too, after a grace period)
+	rcu_barrier();
+	kmem_cache_destroy(lc_chunk_cache);
 
 	devno = MKDEV(lc_dev_major, lc_dev_minor);
-	cdev_del(&lc_states_dev.cdev);
-
-	unregister_chrdev_region(devno, LC_MINOR_COUNT);
+	unregister_chrdev_region(devno, lc_channels);
 
 	for(i=0;i<leds.led_count;i++)
 	{
@@ -895,6 +3763,8 @@ void lc_exit_module(void)
 		kobject_del(kobj);
 		kobject_put(kobj);
 	}
+	// the runner is gone, nobody else uses it
+	kfree(rcu_dereference_protected(leds.outputs, 1));
 	kobj = &leds.kobj;
 	kobject_del(kobj);
 	kobject_put(kobj);
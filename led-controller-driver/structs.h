@@ -11,12 +11,23 @@
 
 #include <linux/cdev.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/ktime.h>
+#include <linux/llist.h>
+#include <linux/workqueue.h>
+#include <linux/refcount.h>
+#include <linux/wait.h>
+
+#include "ledcontroller.h"
 
 /*
 	Leds/Kobjects
 */
 
 #define LEDS_MAX 32
+/* mask with the first `count` leds set */
+#define LEDS_MASK(count) ((u32)((1ULL << (count)) - 1))
 
 struct led {
 	struct kobject kobj;
@@ -25,57 +36,379 @@ struct led {
 	struct rw_semaphore pin_number_sem;
 };
 
+/*
+	The GPIOs of the leds, as the runner sees them: never changed once
+	published, a new one is built (and swapped in) when the pins change
+*/
+struct lc_outputs {
+	/* the number of leds */
+	int count;
+	struct gpio_desc *gpios[LEDS_MAX];
+	/* the leds whose GPIO can sleep, so can't be set from the timer */
+	u32 cansleep;
+};
+
 /* for params */
 struct leds {
 	/* the number of leds*/
 	int led_count;
 	/* we limit the amount of leds */
 	struct led *leds[LEDS_MAX];
+	/* their GPIOs, for the runner (SRCU, as setting them may sleep) */
+	struct lc_outputs __rcu *outputs;
+	/* serializes publishing `outputs` */
+	struct mutex outputs_mx;
+	/* the values last written to the GPIOs, one bit per led */
+	u32 output;
 	struct rw_semaphore rw_semaphore;
 	/* sysfs entry/folder for 'leds' */
 	struct kobject kobj;
 };
 
 /*
-	LinkedList/CharDev
+	States/CharDev
 */
 
-/* single linked-list */
-struct ll_node {
-	struct ll_node *next;
-	/* the led values */
-	unsigned char *led_values;
-	/* how long to hold this state */
+/* a single state, values are kept inline */
+struct lc_state {
+	/* the led values, bit `i` is led `i` */
+	u32 values;
+	/* how long to hold this state, in microseconds */
 	unsigned time;
+};
+
+/*
+	Ops, for repeated blocks and sub-patterns, are kept as states with
+	no time: the op is in the top byte of `values`, its argument below.
+	They're expanded by the runner, as it goes through them
+*/
+#define LC_OP(values)         ((values) >> 24)
+#define LC_OP_ARG(values)     ((values) & LC_OP_ARG_MAX)
+#define LC_OP_MAKE(op, arg)   (((u32)(op) << 24) | (arg))
+#define LC_OP_ARG_MAX         0xffffff
+#define LC_OP_REPEAT 1	/* `repeat N`: the block up to `end`, N times */
+#define LC_OP_END    2
+#define LC_OP_CALL   3	/* `call name`: a sub-pattern, the argument is its index */
+#define LC_OP_RUN    4	/* the state before, N more times (identical lines are stored once) */
+/* only while parsing, they aren't stored */
+#define LC_OP_DEF    5	/* `def name`: a sub-pattern, up to `enddef` */
+#define LC_OP_ENDDEF 6
+
+/* the deepest blocks (repeats and calls) can be nested */
+#define LC_NEST_MAX 8
+
+/*
+	the states table: chunks of states (a page each), found by where they
+	start, so we get O(log) indexing without ever moving (or reallocating)
+	the states themselves. Appends fill the last chunk, edits rebuild the
+	chunks they touch, so chunks aren't always full
+*/
+#define LC_CHUNK_SHIFT 9
+#define LC_CHUNK_STATES (1 << LC_CHUNK_SHIFT)
+
+struct lc_chunk {
+	struct lc_state *states;
+	/* the index of its first state */
+	unsigned start;
+	/* for writers and readers: the lines its states read back as */
+	unsigned lines;
+};
+
+/* the chunk table, replaced as a whole (RCU) when it grows, or it's edited */
+/* the last edits a table keeps, for the runner to catch up with */
+#define LC_EDITS_KEPT 8
+struct lc_edit {
+	/* states [first, last) were replaced, the ones after moved by `delta` */
+	unsigned first, last;
+	int delta;
+};
+struct lc_chunks {
+	struct rcu_head rcu;
+	/* capacity of `chunks`, and how many are in use */
+	unsigned len, used;
+	/* the number of states, published after they're written */
+	unsigned count;
+	/* once an edit replaced it: the chunks only it had, freed with it, [first, last) */
+	unsigned dropped_first, dropped_last;
+	/*
+		how many edits the states went through, and the last ones (edit
+		`n` at `n-1` % LC_EDITS_KEPT), the runner moves its cursors by them
+	*/
+	unsigned edits;
+	struct lc_edit edit_log[LC_EDITS_KEPT];
+	struct lc_chunk chunks[];
+};
+
+/*
+	States are appended: a state is written before `count` covers it,
+	and never changed after (but for the count of the last run), so the
+	runner can read them without locking, while a writer adds more.
+	Edits go to new chunks, in a new table
+*/
+struct lc_states {
+	struct lc_chunks __rcu *table;
+	/* the number of states, for writers (the runner has the table's) */
+	unsigned count;
+};
+
+/*
+	A track: states for some of the leds, played on their own time,
+	looping on their own. A sequence is either frames, a single track
+	for all of the channel's leds, or events, a track per led (or group
+	of leds), so leds blinking at unrelated periods don't need to be
+	expanded into frames
+*/
+#define LC_TRACK_FRAMES LEDS_MASK(LEDS_MAX)
+
+struct lc_track {
+	/* the leds it plays, LC_TRACK_FRAMES for all of the channel's */
+	u32 leds;
+	struct lc_states states;
+	/* the number of lines they read back as, with the runs expanded */
+	unsigned lines;
+	/*
+		for writers: the blocks still open, and the deepest they got,
+		the open ones with no states yet (bit per depth), and whether
+		anything plays at all (for sub-patterns)
+	*/
+	u8 depth, max_depth, bare;
+	bool playable;
+};
+
+/* the longest name of a sub-pattern, with the NULL byte */
+#define LC_NAME_MAX 16
+#define LC_SUBS_MAX 16
+
+/* a sub-pattern, its states can be played from any track */
+struct lc_sub {
+	char name[LC_NAME_MAX];
+	/* the leds are only for how it reads back */
+	struct lc_track track;
+};
+
+/* a parsed state, and the track it goes to */
+struct lc_event {
+	u32 track;
+	struct lc_state state;
+	/* for ops on sub-patterns */
+	char name[LC_NAME_MAX];
+};
+
+struct lc_file;
+
+/*
+	A sequence of states, uploaded and committed as a whole
+*/
+struct lc_sequence {
+	/* tracks are only ever added, `tracks_len` is published after they're set */
+	struct lc_track tracks[LEDS_MAX];
+	unsigned tracks_len;
+	/* and the same for sub-patterns, they're always defined before they're used */
+	struct lc_sub subs[LC_SUBS_MAX];
+	unsigned subs_len;
+	/* for writers: the sub-pattern being defined, -1 if none */
+	int defining;
 	/*
-		the size of the string representation,
-		including the final newline,
-		excluding NULL byte
+		and the file that left blocks open (`def`, `repeat`), the only one
+		that can write until it closes them, or the file. Not for staged
+		states, they're their file's anyway
 	*/
-	unsigned repr_size;
+	struct lc_file *writer;
+	/* saved in the library (even if not anymore), so never changed again */
+	bool saved;
+	/*
+		for the runner: the saved states this is a copy of, to append to.
+		If they're playing, it goes on in the copy from where they are
+	*/
+	struct lc_sequence *copy_of;
+	/* one for the channel (while it's seq, pending or playing), one for each name in the library */
+	refcount_t refs;
+	/* for freeing it, once the runner is done with it */
+	struct llist_node retired;
+};
+
+/* a sequence kept in a channel's library, by name */
+#define LC_LIBRARY_MAX 8
+
+struct lc_saved {
+	char name[LC_NAME_MAX];
+	struct lc_sequence *seq;
+};
+
+/*
+	Runner statistics
+*/
+
+/* a log2 histogram of durations, in nanoseconds: bucket `i` is from 2^i, the first one from 0 */
+#define LC_HIST_BUCKETS 32
+
+struct lc_hist {
+	u64 count, sum, max;
+	u64 buckets[LC_HIST_BUCKETS];
+};
+
+/* when the runner switches to newly committed states */
+#define LC_COMMIT_NOW   0	/* right away, cutting the current state short */
+#define LC_COMMIT_FRAME 1	/* at the end of the current state */
+#define LC_COMMIT_LOOP  2	/* at the end of the current loop */
+
+struct lc_states_dev;
+
+/* states parsed from a write, appended to the table in one go */
+#define LC_BATCH_STATES 128
+
+/* per open file */
+struct lc_file {
+	struct lc_states_dev *dev;
+	/* when open as TRUNC, the states being uploaded, committed on release */
+	struct lc_sequence *staging;
+	/* buffer for partial writes, `partial_len` is how much is used */
+	char *partial;
+	size_t partial_len;
+	/* parsed states, not yet in the table */
+	struct lc_event *batch;
+	/* whether states were lost (out of memory, or budget), staged ones aren't committed then */
+	bool lost;
+	/* whether it reads events, and the next one it gets (under the channel's `events_lock`) */
+	bool events;
+	u64 events_pos;
+	/* what's being read: a state (of `read_track`), or a sub-pattern's `def`/`enddef` */
+	int read_line;
+	struct lc_track *read_track;
+	struct lc_sub *read_sub;
+	/*
+		and where, for sequential reads: line `read_pos` is state `read_index`,
+		repeated `read_rep` times before, as of commit `read_commits`
+	*/
+	loff_t read_pos;
+	unsigned read_index, read_rep, read_commits;
+	/* for writes on the same file */
+	struct mutex write_mx;
+};
+
+/* we limit the amount of channels (minors) */
+#define LC_CHANNELS_MAX 8
+
+/* a block a cursor is in: a repeat, or a call */
+struct lc_frame {
+	/* for repeats, where the block starts, for calls, where to return to */
+	struct lc_track *at;
+	unsigned pos, edits;
+	/* repeats left, LC_FRAME_CALL for calls */
+	unsigned remaining;
+};
+#define LC_FRAME_CALL UINT_MAX
+
+/* where the runner is, on a track */
+struct lc_cursor {
+	struct lc_states_dev *dev;
+	/* the track, in `playing` */
+	unsigned track;
+	/* whether it's started (and scheduled) */
+	bool started;
+	/*
+		the states it's going through (the track's, or a sub-pattern's), the
+		next one, and as of how many edits of them (for frames too)
+	*/
+	struct lc_track *at;
+	unsigned pos, edits;
+	/* the blocks it's in */
+	struct lc_frame stack[LC_NEST_MAX];
+	unsigned depth;
+	/* the state it's on, its index, and for how long (with its run), in microseconds */
+	struct lc_state last;
+	unsigned index;
+	u64 hold;
+	/*
+		absolute expiry of the current state, accumulated from the
+		start of the sequence so frame durations never drift
+	*/
+	ktime_t deadline;
+	/* while paused: whether it was scheduled, and what was left of its state */
+	bool parked;
+	ktime_t left;
+};
+
+/* the events kept for readers, a power of 2 */
+#define LC_EVENTS_MAX 128
+
+/* playback rate, in percent of real time */
+#define LC_RATE_UNIT 100
+#define LC_RATE_MAX  (LC_RATE_UNIT * 100)
+
+/* a seek, to a line of the frames of `seq` */
+struct lc_seek {
+	struct lc_sequence *seq;
+	/* the frames track, the state it's in (as of `edits` of it), and how many lines into its run */
+	unsigned track, index, edits, rep;
 };
 
+/* a channel: its own states, played on its own leds, on its own time */
 struct lc_states_dev {
 	struct cdev cdev;
+	/* position in the channels (and minor) */
+	int index;
 
 	/*
 		the states:
-		- head -> the list
-		- tail -> for fast appending
-		- cur  -> tracker of current state
+		- seq     -> the last committed, what's read and appended to
+		- pending -> committed, but not yet picked up by the runner
+		- playing -> what the runner is going through
+		`seq` is always either `pending` or `playing`
 	*/
-	struct ll_node *head, *tail, *cur;
-	//unsigned states_len;
-	/* semaphore to access it */
+	struct lc_sequence *seq, *pending, *playing;
+	/* whether it's playing, and where, on each of the tracks */
+	bool running;
+	struct lc_cursor cursors[LEDS_MAX];
+	/* semaphore to access `seq` */
 	struct rw_semaphore semaphore;
+	/* LC_COMMIT_* */
+	int commit_at;
+	/* bumped on each commit (and edit), for readers picking up where they stopped */
+	unsigned commits;
+	/* saved sequences, played without uploading them again (under `semaphore`) */
+	struct lc_saved library[LC_LIBRARY_MAX];
+	/* sequences the runner is done with, freed from a work item */
+	struct llist_head retired;
+	struct work_struct retire_work;
+	/* signals for the runner, CSIGNAL_* bits */
+	unsigned long signals;
+	/* to be started by the runner (or its new tracks), on its next tick */
+	bool starting;
 
-	/* buffer for partial writes */
-	char *partial;
-	int partial_len;
-	struct mutex partial_mx;
+	/*
+		playback controls, set by users, applied by the runner:
+		- pause -> hold the states (and the leds) where they are
+		- rate  -> LC_RATE_UNIT is real time
+		- loops -> how many times the first track plays, 0 for ever
+		- seek  -> where to go next (under `seek_lock`)
+	*/
+	bool pause;
+	unsigned rate, loops;
+	struct lc_seek seek;
+	spinlock_t seek_lock;
+	/* and the runner's: whether it's paused, has a seek to do, and the loops played */
+	bool paused, seeking;
+	struct lc_seek seek_to;
+	unsigned loops_done;
 
-	/* and the leds */
+	/*
+		events, for the files reading them: the runner writes them to
+		a ring, over the oldest, `events_head` is how many it ever wrote.
+		Not kept when there's no one to read them
+	*/
+	struct ledc_event events[LC_EVENTS_MAX];
+	u64 events_head;
+	raw_spinlock_t events_lock;
+	wait_queue_head_t events_wq;
+	atomic_t listeners;
+
+	/* and the leds, this channel only plays the ones in `leds_mask` */
 	struct leds *leds;
+	u32 leds_mask;
+
+	/* sysfs entry/folder, under 'channels' */
+	struct kobject kobj;
 };
 
 #endif
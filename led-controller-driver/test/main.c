@@ -0,0 +1,421 @@
+/*
+	Test of the /dev/ledc ioctls, and the events
+
+	The module has to be loaded with 2 leds, both with a pin set (see
+	/etc/ledcontroller-ioctl-test.sh), the device is the argument:
+
+	- append -> LEDC_IOC_APPEND, and how invalid states stop it
+	- edit   -> LEDC_IOC_EDIT: replace, insert, delete, and what fails
+	            (with nothing changed), while the states play
+	- sendfile() of the states, as ledserver sends them
+	- appends to saved states, while they're playing
+	- events -> LEDC_IOC_EVENTS, read blocking and non-blocking, with poll()
+	- the playback controls: pause/resume, seek, rate and loops
+
+	Returns 0 if all of them pass
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/sendfile.h>
+
+#include "../ledcontroller.h"
+
+#define DEV_FILE "/dev/ledc"
+
+static const char *dev_file = DEV_FILE;
+
+/* the channel's attributes, for the library */
+#define STATES_DIR "/sys/module/ledcontroller/states/"
+
+/* how long to wait for an event, states are 100ms at most */
+#define EVENT_TIMEOUT_MS 2000
+
+#define MS 1000
+#define NS_PER_MS 1000000LL
+
+#define CHECK(cond) do { \
+	if(!(cond)) \
+	{ \
+		fprintf(stderr, "error: %s:%d: %s (%s)\n", __func__, __LINE__, #cond, strerror(errno)); \
+		return -1; \
+	} \
+} while(0)
+
+/* replace the states with `text`, committed once it's closed */
+static int upload(const char *text)
+{
+	int fd, r;
+	if((fd = open(dev_file, O_WRONLY)) < 0)
+		return -1;
+	r = write(fd, text, strlen(text));
+	close(fd);
+	return r == (int)strlen(text) ? 0 : -1;
+}
+
+/* write `value` to the channel's `attr` */
+static int states_set(const char *attr, const char *value)
+{
+	char path[64];
+	int fd, r;
+	snprintf(path, sizeof(path), STATES_DIR "%s", attr);
+	if((fd = open(path, O_WRONLY)) < 0)
+		return -1;
+	r = write(fd, value, strlen(value));
+	close(fd);
+	return r == (int)strlen(value) ? 0 : -1;
+}
+
+/* whether the states read back as `text` */
+static int states_are(const char *text)
+{
+	char buffer[4096];
+	int fd, r, len = 0;
+	if((fd = open(dev_file, O_RDONLY)) < 0)
+		return 0;
+	while(len < (int)sizeof(buffer) - 1 && (r = read(fd, buffer + len, sizeof(buffer) - 1 - len)) > 0)
+		len += r;
+	close(fd);
+	buffer[len] = 0;
+	if(strcmp(buffer, text))
+	{
+		fprintf(stderr, "debug: states are '%s', not '%s'\n", buffer, text);
+		return 0;
+	}
+	return 1;
+}
+
+/* the next event that's `reason` (and on `track`, for states), the others are skipped */
+static int next_event(int fd, __u32 reason, int track, struct ledc_event *ev)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	while(poll(&pfd, 1, EVENT_TIMEOUT_MS) == 1)
+	{
+		if(read(fd, ev, sizeof(*ev)) != sizeof(*ev))
+			continue;
+		if(ev->reason == reason && (reason != LEDC_EVENT_STATE || (int)ev->track == track))
+			return 0;
+	}
+	fprintf(stderr, "debug: no event %u\n", reason);
+	return -1;
+}
+
+/* skip what's there already */
+static void drain_events(int fd)
+{
+	struct ledc_event ev;
+	while(read(fd, &ev, sizeof(ev)) == sizeof(ev))
+		;
+}
+
+static long append(int fd, struct ledc_state *states, __u32 count)
+{
+	struct ledc_append arg = {
+		.states = (__u64)(unsigned long)states,
+		.count = count
+	};
+	return ioctl(fd, LEDC_IOC_APPEND, &arg);
+}
+
+static long edit(int fd, __u32 leds, __u32 index, __u32 remove, struct ledc_state *states, __u32 count)
+{
+	struct ledc_edit arg = {
+		.index = index,
+		.remove = remove,
+		.states = (__u64)(unsigned long)states,
+		.count = count,
+		.leds = leds
+	};
+	return ioctl(fd, LEDC_IOC_EDIT, &arg);
+}
+
+static int test_append(int fd)
+{
+	struct ledc_state states[] = {
+		{ 1, 100*MS },
+		{ 2, 100*MS },
+		{ 3, 250*MS }
+	};
+	struct ledc_state invalid[] = {
+		{ 1, 100*MS },
+		{ 0, 0 }
+	};
+	struct ledc_state off_leds[] = {
+		{ 4, 100*MS }
+	};
+	CHECK(!upload(""));
+	CHECK(append(fd, states, 3) == 3);
+	CHECK(states_are("1,0,100ms\n0,1,100ms\n1,1,250ms\n"));
+	// up to the first invalid one
+	CHECK(append(fd, invalid, 2) == 1);
+	CHECK(append(fd, invalid + 1, 1) < 0 && errno == EINVAL);
+	// a led past `led_count`
+	CHECK(append(fd, off_leds, 1) < 0 && errno == EINVAL);
+	CHECK(states_are("1,0,100ms\n0,1,100ms\n1,1,250ms\n1,0,100ms\n"));
+	return 0;
+}
+
+static int test_edit(int fd)
+{
+	struct ledc_state replace[] = { { 0, 200*MS } };
+	struct ledc_state insert[] = { { 3, 50*MS } };
+	struct ledc_state invalid[] = { { 1, 0 } };
+	CHECK(!upload("1,0,100ms\n0,1,100ms\n1,1,100ms\n"));
+	// replace
+	CHECK(!edit(fd, 0, 1, 1, replace, 1));
+	CHECK(states_are("1,0,100ms\n0,0,200ms\n1,1,100ms\n"));
+	// insert, before the first one
+	CHECK(!edit(fd, 0, 0, 0, insert, 1));
+	CHECK(states_are("1,1,50ms\n1,0,100ms\n0,0,200ms\n1,1,100ms\n"));
+	// delete, the last one
+	CHECK(!edit(fd, 0, 3, 1, NULL, 0));
+	CHECK(states_are("1,1,50ms\n1,0,100ms\n0,0,200ms\n"));
+	// a track there's none of, past the end, and invalid states: nothing changes
+	CHECK(edit(fd, 1, 0, 0, insert, 1) < 0 && errno == EINVAL);
+	CHECK(edit(fd, 0, 2, 2, NULL, 0) < 0 && errno == EINVAL);
+	CHECK(edit(fd, 0, 0, 1, invalid, 1) < 0 && errno == EINVAL);
+	CHECK(states_are("1,1,50ms\n1,0,100ms\n0,0,200ms\n"));
+	return 0;
+}
+
+/* a failed edit of an upload leaves it as it was, it's still committed */
+static int test_edit_staged(void)
+{
+	struct ledc_state insert[] = { { 1, 50*MS } };
+	int staged_fd;
+	long r;
+	CHECK((staged_fd = open(dev_file, O_WRONLY)) >= 0);
+	r = write(staged_fd, "1,0,100ms\n", 10) == 10 ? edit(staged_fd, 1, 0, 0, insert, 1) : 0;
+	close(staged_fd);
+	CHECK(r < 0 && errno == EINVAL);
+	CHECK(states_are("1,0,100ms\n"));
+	return 0;
+}
+
+/* states inserted before where the track is don't play it back (or skip) */
+static int test_edit_playing(int fd, int events_fd)
+{
+	struct ledc_state insert[] = { { 0, 100*MS } };
+	struct ledc_event ev;
+	CHECK(!upload("1,0,100ms\n0,1,100ms\n1,1,100ms\n"));
+	CHECK(!next_event(events_fd, LEDC_EVENT_START, 0, &ev));
+	CHECK(!next_event(events_fd, LEDC_EVENT_STATE, 0, &ev) && !next_event(events_fd, LEDC_EVENT_STATE, 0, &ev));
+	CHECK(ev.index == 1);
+	CHECK(!edit(fd, 0, 0, 0, insert, 1));
+	// the one that was next, where it is now
+	CHECK(!next_event(events_fd, LEDC_EVENT_STATE, 0, &ev));
+	CHECK(ev.index == 3 && ev.values == 3);
+	return 0;
+}
+
+/* appends to saved states that are playing go on from where they are, nothing starts over */
+static int test_saved_append(int fd, int events_fd)
+{
+	struct ledc_state more[] = {
+		{ 3, 100*MS }
+	};
+	struct pollfd pfd = { .fd = events_fd, .events = POLLIN };
+	struct ledc_event ev;
+	CHECK(!upload("1,0,100ms\n0,1,100ms\n"));
+	CHECK(!states_set("save", "test"));
+	// playing: they're the ones the copy goes on from
+	CHECK(!next_event(events_fd, LEDC_EVENT_START, 0, &ev));
+	CHECK(!next_event(events_fd, LEDC_EVENT_STATE, 0, &ev) && !next_event(events_fd, LEDC_EVENT_STATE, 0, &ev));
+	drain_events(events_fd);
+	CHECK(append(fd, more, 1) == 1);
+	// played once it's reached, without a start (or a loop) on the way
+	ev.reason = 0;
+	while(!(ev.reason == LEDC_EVENT_STATE && ev.index == 2) && poll(&pfd, 1, EVENT_TIMEOUT_MS) == 1)
+	{
+		if(read(events_fd, &ev, sizeof(ev)) != sizeof(ev))
+			continue;
+		CHECK(ev.reason != LEDC_EVENT_START && ev.reason != LEDC_EVENT_LOOP);
+	}
+	CHECK(ev.reason == LEDC_EVENT_STATE && ev.index == 2 && ev.values == 3);
+	CHECK(!states_set("delete", "test"));
+	return 0;
+}
+
+/* the states spliced out, the same as read */
+static int test_sendfile(void)
+{
+	const char *text = "1,0,100ms\n0,1,100ms\n";
+	char buffer[64];
+	int fd, pipe_fds[2], r;
+	CHECK(!upload(text));
+	CHECK((fd = open(dev_file, O_RDONLY)) >= 0);
+	if(pipe(pipe_fds) < 0)
+	{
+		close(fd);
+		CHECK(0);
+	}
+	r = sendfile(pipe_fds[1], fd, NULL, sizeof(buffer));
+	close(fd);
+	close(pipe_fds[1]);
+	if(r == (int)strlen(text))
+		r = read(pipe_fds[0], buffer, sizeof(buffer));
+	close(pipe_fds[0]);
+	CHECK(r == (int)strlen(text) && !memcmp(buffer, text, r));
+	return 0;
+}
+
+/* events, as they're read: blocking, non-blocking, and polled */
+static int test_events(int fd)
+{
+	struct pollfd pfd = { .events = POLLIN };
+	struct ledc_event ev;
+	int block_fd, nonblock_fd, status;
+	pid_t pid;
+	CHECK((block_fd = open(dev_file, O_RDONLY)) >= 0);
+	CHECK((nonblock_fd = open(dev_file, O_RDONLY | O_NONBLOCK)) >= 0);
+	CHECK(!ioctl(block_fd, LEDC_IOC_EVENTS));
+	CHECK(!ioctl(nonblock_fd, LEDC_IOC_EVENTS));
+	CHECK(!upload("1,0,100ms\n0,1,100ms\n"));
+	// whole records only
+	CHECK(read(block_fd, &ev, sizeof(ev) - 1) < 0 && errno == EINVAL);
+	CHECK(read(block_fd, &ev, sizeof(ev)) == sizeof(ev));
+	// when paused there's nothing, the non-blocking read doesn't wait for it
+	CHECK(!ioctl(fd, LEDC_IOC_PAUSE));
+	CHECK(!next_event(nonblock_fd, LEDC_EVENT_PAUSE, 0, &ev));
+	drain_events(nonblock_fd);
+	CHECK(!fcntl(block_fd, F_SETFL, O_NONBLOCK));
+	drain_events(block_fd);
+	CHECK(!fcntl(block_fd, F_SETFL, 0));
+	CHECK(read(nonblock_fd, &ev, sizeof(ev)) < 0 && errno == EAGAIN);
+	pfd.fd = nonblock_fd;
+	CHECK(poll(&pfd, 1, 0) == 0);
+	// the blocking read waits, until it's resumed (a bit later)
+	CHECK((pid = fork()) >= 0);
+	if(!pid)
+	{
+		usleep(100 * MS);
+		_exit(ioctl(fd, LEDC_IOC_RESUME) ? 1 : 0);
+	}
+	CHECK(read(block_fd, &ev, sizeof(ev)) == sizeof(ev) && ev.reason == LEDC_EVENT_RESUME);
+	CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && !WEXITSTATUS(status));
+	// and poll has the other one readable
+	CHECK(poll(&pfd, 1, EVENT_TIMEOUT_MS) == 1 && (pfd.revents & POLLIN));
+	CHECK(read(nonblock_fd, &ev, sizeof(ev)) == sizeof(ev) && ev.reason == LEDC_EVENT_RESUME);
+	CHECK(!next_event(nonblock_fd, LEDC_EVENT_STATE, 0, &ev));
+	close(block_fd);
+	close(nonblock_fd);
+	return 0;
+}
+
+/* seek, to lines as they read back (the sub-pattern first) */
+static int test_seek(int fd, int events_fd)
+{
+	struct pollfd pfd = { .fd = events_fd, .events = POLLIN };
+	struct ledc_event ev;
+	__u32 line;
+	CHECK(!upload("def blink\n1,1,100ms\nenddef\n1,0,100ms\n0,1,100ms\n0,0,100ms\n"));
+	CHECK(!next_event(events_fd, LEDC_EVENT_START, 0, &ev));
+	// in the sub-pattern, and past the end
+	line = 1;
+	CHECK(ioctl(fd, LEDC_IOC_SEEK, &line) < 0 && errno == EINVAL);
+	line = 6;
+	CHECK(ioctl(fd, LEDC_IOC_SEEK, &line) < 0 && errno == EINVAL);
+	// paused, so nothing is played until the seek
+	CHECK(!ioctl(fd, LEDC_IOC_PAUSE));
+	CHECK(!next_event(events_fd, LEDC_EVENT_PAUSE, 0, &ev));
+	drain_events(events_fd);
+	// `0,0,100ms`, the third state of the track, straight there: no start, nothing before it
+	line = 5;
+	CHECK(!ioctl(fd, LEDC_IOC_SEEK, &line));
+	CHECK(poll(&pfd, 1, EVENT_TIMEOUT_MS) == 1 && read(events_fd, &ev, sizeof(ev)) == sizeof(ev));
+	CHECK(ev.reason == LEDC_EVENT_STATE && ev.index == 2 && ev.values == 0);
+	CHECK(!ioctl(fd, LEDC_IOC_RESUME));
+	// tracks of their own leds, no frames to seek in
+	CHECK(!upload("@0:1,100ms\n"));
+	line = 0;
+	CHECK(ioctl(fd, LEDC_IOC_SEEK, &line) < 0 && errno == EINVAL);
+	return 0;
+}
+
+/* rate, as the time between states */
+static int test_rate(int fd, int events_fd)
+{
+	struct ledc_event first, second;
+	__u32 rate;
+	CHECK(!upload("1,0,100ms\n0,1,100ms\n"));
+	CHECK(!next_event(events_fd, LEDC_EVENT_START, 0, &first));
+	rate = 0;
+	CHECK(ioctl(fd, LEDC_IOC_RATE, &rate) < 0 && errno == EINVAL);
+	rate = 10001;
+	CHECK(ioctl(fd, LEDC_IOC_RATE, &rate) < 0 && errno == EINVAL);
+	rate = 200;
+	CHECK(!ioctl(fd, LEDC_IOC_RATE, &rate));
+	// from the next state on, times are when they were due
+	CHECK(!next_event(events_fd, LEDC_EVENT_STATE, 0, &first));
+	CHECK(!next_event(events_fd, LEDC_EVENT_STATE, 0, &first));
+	CHECK(!next_event(events_fd, LEDC_EVENT_STATE, 0, &second));
+	CHECK(second.time - first.time == 50 * NS_PER_MS);
+	rate = 100;
+	CHECK(!ioctl(fd, LEDC_IOC_RATE, &rate));
+	return 0;
+}
+
+/* loops, the channel stops after them, and starts over when they're set again */
+static int test_loops(int fd, int events_fd)
+{
+	struct ledc_event ev;
+	__u32 loops = 1;
+	CHECK(!upload("1,0,20ms\n0,1,20ms\n"));
+	CHECK(!ioctl(fd, LEDC_IOC_LOOPS, &loops));
+	CHECK(!next_event(events_fd, LEDC_EVENT_STOP, 0, &ev));
+	loops = 0;
+	CHECK(!ioctl(fd, LEDC_IOC_LOOPS, &loops));
+	CHECK(!next_event(events_fd, LEDC_EVENT_START, 0, &ev));
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int fd, events_fd, failed = 0;
+	if(argc > 1)
+		dev_file = argv[1];
+
+	// appends (and the controls) through a file open to append, nothing's staged
+	if((fd = open(dev_file, O_WRONLY | O_APPEND)) < 0)
+	{
+		fprintf(stderr, "error: failed to open dev file: %s\n", strerror(errno));
+		return -1;
+	}
+	if((events_fd = open(dev_file, O_RDONLY | O_NONBLOCK)) < 0 || ioctl(events_fd, LEDC_IOC_EVENTS))
+	{
+		fprintf(stderr, "error: failed to read events: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	failed |= test_append(fd);
+	failed |= test_edit(fd);
+	failed |= test_edit_staged();
+	drain_events(events_fd);
+	failed |= test_edit_playing(fd, events_fd);
+	failed |= test_sendfile();
+	drain_events(events_fd);
+	failed |= test_saved_append(fd, events_fd);
+	failed |= test_events(fd);
+	drain_events(events_fd);
+	failed |= test_seek(fd, events_fd);
+	drain_events(events_fd);
+	failed |= test_rate(fd, events_fd);
+	drain_events(events_fd);
+	failed |= test_loops(fd, events_fd);
+
+	// and nothing left playing
+	upload("");
+	close(events_fd);
+	close(fd);
+	if(!failed)
+		printf("All tests passed!\n");
+	return failed;
+}
@@ -1,14 +1,23 @@
 /*
 	Socket server to expose the /dev/ledc to the network
 
-	This uses detached threads
+	An event loop (epoll) per worker thread, each with its own listening
+	socket (SO_REUSEPORT, the kernel spreads the connections), for all of
+	its clients. Their sockets are non-blocking: what's received is kept
+	until it's a whole line, what can't be sent right away is kept until
+	the socket takes it
 
 	Socket commands:
 
 	`>[ <message>]\n` -> truncate and optionally write line
 	`>> <message>\n` -> append line
 	`<\n` -> get current states
+
+	Appends go through a handle each client keeps open, the ones in
+	a row are written in one go. The states are sent straight from the
+	device (sendfile), the commands after wait until they're all sent
 */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,291 +26,778 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <time.h>
 
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
-#include <arpa/inet.h>
+#include <netinet/tcp.h>
 
 #include <pthread.h>
-#include <sys/time.h>
+#include <sched.h>
+#include <arpa/inet.h>
 
 static int _run = 1;
 
 #define DEV_FILE "/dev/ledc"
 
-#define RECV_LEN 256
+/* the longest command line, by default, it's what's kept for each client */
+#define LINE_LEN 4096
 
-struct thread_data {
-	int client_fd;
+/* how much of the states is sent at a time */
+#define DUMP_LEN 65536
+
+static unsigned line_len = LINE_LEN;
+
+/* pending connections, per worker, by default */
+#define BACKLOG 128
+
+static int backlog = BACKLOG;
+
+/* events handled per wait */
+#define MAX_EVENTS 32
+
+/* clients with nothing to say for this long are dropped */
+#define CLIENT_TIMEOUT_MS 1000
+
+struct worker;
+
+struct client {
+	struct worker *w;
+	int fd;
+	/* the device, open for appends, -1 until there's one */
+	int dev_append;
+	/*
+		received, `line_len` of it: what's still to run is from `start`
+		to `end`, moved back to the beginning once there's no more room
+	*/
+	unsigned char *buffer;
+	unsigned start, end;
+	/* to send, from `out_pos`, before the rest of the dump (DUMP_LEN, while there's one) */
+	unsigned char *out;
+	unsigned out_len, out_pos;
+	/* the device, open for a dump (`<`), -1 if none, and whether sendfile() works on it */
+	int dump_fd, dump_sendfile;
+	/* what epoll waits on, and whether it closed its end */
+	unsigned events;
+	int eof;
+	/* last time it did something, for the timeout */
+	long long last_ms;
+	/* in its worker's clients, least recently active first, or in `closed` */
+	struct client *prev, *next;
+};
+
+struct worker {
+	pthread_t thread;
+	int index;
+	int server_fd, epoll_fd;
+	/*
+		its clients, the ones to expire first at the head, and the ones
+		closed while handling events, freed after all of them are handled
+	*/
+	struct client *clients_head, *clients_tail, *closed;
+	/* whether it stopped on an error */
+	int failed;
 };
 
+static long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void client_unlink(struct client *c)
+{
+	struct worker *w = c->w;
+	if(c->prev)
+		c->prev->next = c->next;
+	else
+		w->clients_head = c->next;
+	if(c->next)
+		c->next->prev = c->prev;
+	else
+		w->clients_tail = c->prev;
+	c->prev = c->next = NULL;
+}
+
+/* it did something, to the end of the line for the timeout */
+static void client_touch(struct client *c)
+{
+	struct worker *w = c->w;
+	if(c->prev || c->next || w->clients_head == c)
+		client_unlink(c);
+	c->last_ms = now_ms();
+	c->prev = w->clients_tail;
+	if(w->clients_tail)
+		w->clients_tail->next = c;
+	else
+		w->clients_head = c;
+	w->clients_tail = c;
+}
+
+/* the socket is closed now, the rest when the events are handled */
+static void client_close(struct client *c)
+{
+	/* closing it takes it out of epoll */
+	close(c->fd);
+	c->fd = -1;
+	if(c->dev_append >= 0)
+		close(c->dev_append);
+	if(c->dump_fd >= 0)
+		close(c->dump_fd);
+	client_unlink(c);
+	c->next = c->w->closed;
+	c->w->closed = c;
+}
+
+static void clients_free_closed(struct worker *w)
+{
+	struct client *c;
+	while((c = w->closed))
+	{
+		w->closed = c->next;
+		free(c->buffer);
+		free(c->out);
+		free(c);
+	}
+}
+
 /*
-	since threads are fire and forget and `data` is allocated on the heap,
-	threads themselves will need to `free()` it before exiting
+	What epoll waits on, for the client: nothing is received while
+	there's a dump, only told to epoll when it changes
 */
-void * thread_runner(void *data)
+static int client_watch(int epoll_fd, struct client *c, int op)
+{
+	struct epoll_event ev = {
+		.events = (c->eof || c->dump_fd >= 0 ? 0 : EPOLLIN)
+			| (c->out_len || c->dump_fd >= 0 ? EPOLLOUT : 0),
+		.data.ptr = c
+	};
+	if(op == EPOLL_CTL_MOD && ev.events == c->events)
+		return 0;
+	c->events = ev.events;
+	if(epoll_ctl(epoll_fd, op, c->fd, &ev) < 0)
+	{
+		fprintf(stderr, "error: failed to watch client: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* append `len` bytes of whole lines, on the client's handle */
+static int client_append(struct client *c, unsigned char *data, unsigned len)
 {
-	struct thread_data *td = (struct thread_data*)data;
-	unsigned char *buffer = NULL, *newline, *msg;
-	unsigned buffer_len = 0, used_len = 0;
+	int r;
+	if(!len)
+		return 0;
+	if(c->dev_append < 0 && (c->dev_append = open(DEV_FILE, O_WRONLY|O_APPEND|O_CLOEXEC)) < 0)
+	{
+		fprintf(stderr, "error: failed to open dev file: %s\n", strerror(errno));
+		return -1;
+	}
+	while(len)
+	{
+		if((r = write(c->dev_append, data, len)) < 0)
+		{
+			fprintf(stderr, "error: failed to write to dev file: %s\n", strerror(errno));
+			return -1;
+		}
+		len -= r;
+		data += r;
+	}
+	return 0;
+}
+
+/* hold back partial segments, for the whole of a dump */
+static void client_cork(struct client *c, int cork)
+{
+	if(setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork)) < 0)
+		fprintf(stderr, "warning: failed to set TCP_CORK: %s\n", strerror(errno));
+}
+
+/* a single command (but append), the line is from `buffer` to `newline` */
+static int client_command(struct client *c, unsigned char *buffer, unsigned char *newline)
+{
+	unsigned char *msg;
 	int r;
 	int dev_file = -1;
 
-	{ /* set socket timeout */
-		struct timeval timeout = {
-			.tv_sec = 1,
-			.tv_usec = 0
-		};
-		if(setsockopt(td->client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+	/* write */
+	if(buffer[0] == '>')
+	{
+		msg = buffer+1;
+		/* moslty for debug purposes */
+		dev_file = open(DEV_FILE, O_WRONLY|O_TRUNC);
+		if(dev_file < 0)
 		{
-			fprintf(stderr, "error: failed to set socket receive timeout: %s\n", strerror(errno));
-			goto _end;
+			fprintf(stderr, "error: failed to open dev file: %s\n", strerror(errno));
+			return -1;
 		}
-		if(setsockopt(td->client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0)
+		/* skip whitespace to message */
+		while(isblank(*msg)) msg++;
+
+		if(msg != newline)
+		{ /* write to file*/
+			int to_write = newline + 1 - msg;
+			while(to_write)
+			{
+				if((r = write(dev_file, msg, to_write)) < 0)
+				{
+					fprintf(stderr, "error: failed to write to dev file: %s\n", strerror(errno));
+					close(dev_file);
+					return -1;
+				}
+				to_write -= r;
+				msg += r;
+			}
+		}
+	}
+	else if(buffer[0] == '<')
+	{
+		/* closed its end, there's no one to send them to */
+		if(c->eof)
+			return 0;
+		/* ignore the rest of the buffer, the states are sent as the socket takes them */
+		if((c->dump_fd = open(DEV_FILE, O_RDONLY|O_CLOEXEC)) < 0)
 		{
-			fprintf(stderr, "error: failed to set socket send timeout: %s\n", strerror(errno));
-			goto _end;
+			fprintf(stderr, "error: failed to open dev file: %s\n", strerror(errno));
+			return -1;
 		}
+		c->dump_sendfile = 1;
+		client_cork(c, 1);
+		return 0;
 	}
+	else
+	{
+		fprintf(stderr, "error: unknown command from client: '%c...'\n", buffer[0]);
+		return -1;
+	}
+	close(dev_file);	// common
+	return 0;
+}
 
-	while(1)
+/*
+	Run the commands in the whole lines received, the incomplete one is
+	kept. The messages of the appends are packed to the front of the
+	buffer (it's only ever behind the line at hand), until any other
+	command, and written in one go. It stops at a dump, until it's sent
+*/
+static int client_commands(struct client *c)
+{
+	unsigned char *first = c->buffer + c->start, *end = c->buffer + c->end;
+	unsigned char *line = first, *pack = first, *newline, *msg;
+	while(c->dump_fd < 0 && (newline = memchr(line, '\n', end - line)))
 	{
-		/* expand buffer */
-		if((buffer_len - used_len) < RECV_LEN)
+		if(line[0] == '>' && line[1] == '>')
 		{
-			unsigned char *new_buffer = realloc(buffer, used_len + RECV_LEN);
-			if(!new_buffer)
+			/* skip whitespace to message */
+			msg = line+2;
+			while(isblank(*msg)) msg++;
+			if(msg != newline)
 			{
-				fprintf(stderr, "error: failed to allocate memory: %s\n", strerror(errno));
-				break;
+				memmove(pack, msg, newline + 1 - msg);
+				pack += newline + 1 - msg;
 			}
-			buffer_len += RECV_LEN;
-			buffer = new_buffer;
 		}
+		else
+		{
+			/* the appends before it go first */
+			if(client_append(c, first, pack - first))
+				return -1;
+			pack = first;
+			if(client_command(c, line, newline))
+				return -1;
+		}
+		line = newline + 1;
+	}
+	if(client_append(c, first, pack - first))
+		return -1;
+	/* past the lines, from the beginning if there's nothing else */
+	c->start = line - c->buffer;
+	if(c->start == c->end)
+		c->start = c->end = 0;
+	return 0;
+}
 
-		/* receive data */
-		if((r = recv(td->client_fd, buffer+used_len, RECV_LEN, 0)) < 0)
+/* send what's queued, as much as the socket takes */
+static int client_send(struct client *c)
+{
+	int r;
+	while(c->out_pos < c->out_len)
+	{
+		if((r = send(c->fd, c->out+c->out_pos, c->out_len - c->out_pos, MSG_NOSIGNAL)) < 0)
 		{
 			if(errno == EAGAIN || errno == EWOULDBLOCK)
-			{
-				/* receive timeout, all good */
 				break;
-			}
-			fprintf(stderr, "error: failed to receive data from client: %s\n", strerror(errno));
-			break;
-		}
-		if(!r)
-		{
-			// EOF
-			fprintf(stderr, "debug: client disconnect\n");
-			break;
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "error: failed to send to client: %s\n", strerror(errno));
+			return -1;
 		}
-		used_len += r;
+		c->out_pos += r;
+	}
+	if(c->out_pos == c->out_len)
+		c->out_pos = c->out_len = 0;
+	return 0;
+}
 
-		/* look for commands */
-		while((newline = memchr(buffer, '\n', used_len)))
+/* done with the dump, what's left of it isn't sent */
+static void client_dump_end(struct client *c)
+{
+	close(c->dump_fd);
+	c->dump_fd = -1;
+	free(c->out);
+	c->out = NULL;
+	c->out_pos = c->out_len = 0;
+	client_cork(c, 0);
+}
+
+/*
+	Send the states, from the device: with sendfile(), or if the device
+	can't, through a buffer (what the socket doesn't take is queued).
+	1 once it's all sent, 0 if the socket is full
+*/
+static int client_dump(struct client *c)
+{
+	ssize_t r, sent;
+	while(1)
+	{
+		if(c->dump_sendfile)
 		{
-			/* write/append */
-			if(buffer[0] == '>')
+			if((r = sendfile(c->fd, c->dump_fd, NULL, DUMP_LEN)) < 0)
 			{
-				msg = buffer+1;
-				int open_flags = O_WRONLY;
-				/* append? */
-				if(buffer[1] == '>')
+				if(errno == EAGAIN || errno == EWOULDBLOCK)
+					return 0;
+				if(errno == EINTR)
+					continue;
+				if(errno == EINVAL || errno == ENOSYS)
 				{
-					msg++;
-					open_flags |= O_APPEND;
-				}
-				else
-				{
-					/* moslty for debug purposes */
-					open_flags |= O_TRUNC;
-				}
-				dev_file = open(DEV_FILE, open_flags);
-				if(dev_file < 0)
-				{
-					fprintf(stderr, "error: failed to open dev file: %s\n", strerror(errno));
-					goto _end;
-				}
-				/* skip whitespace to message */
-				while(isblank(*msg)) msg++;
-
-				if(msg != newline)
-				{ /* write to file*/
-					int to_write = newline + 1 - msg;
-					while(to_write)
-					{
-						if((r = write(dev_file, msg, to_write)) < 0)
-						{
-							fprintf(stderr, "error: failed to write to dev file: %s\n", strerror(errno));
-							close(dev_file);
-							goto _end;
-						}
-						to_write -= r;
-						msg += r;
-					}
+					/* not for this device, nothing was sent */
+					c->dump_sendfile = 0;
+					continue;
 				}
+				fprintf(stderr, "error: failed to send to client: %s\n", strerror(errno));
+				return -1;
 			}
-			else if(buffer[0] == '<')
+		}
+		else
+		{
+			if(!c->out && !(c->out = malloc(DUMP_LEN)))
 			{
-				/* ignore the rest of the buffer */
-				char rbuffer[128];
-				dev_file = open(DEV_FILE, O_RDONLY);
-				if(dev_file < 0)
-				{
-					fprintf(stderr, "error: failed to open dev file: %s\n", strerror(errno));
-					goto _end;
-				}
-				while((r = read(dev_file, rbuffer, 128)))
-				{
-					int to_write = r, written = 0;
-					if(r<0)
-					{
-						fprintf(stderr, "error: failed to read from dev file: %s\n", strerror(errno));
-						close(dev_file);
-						goto _end;
-					}
-					while(to_write)
-					{
-						if((r = send(td->client_fd, rbuffer+written, to_write, 0)) < 0)
-						{
-							fprintf(stderr, "error: failed to send to client: %s\n", strerror(errno));
-							close(dev_file);
-							goto _end;
-						}
-						to_write -= r;
-						written += r;
-					}
-				}
-				/* EOF on file*/
+				fprintf(stderr, "error: failed to allocate memory: %s\n", strerror(errno));
+				return -1;
 			}
-			else
+			if((r = read(c->dump_fd, c->out, DUMP_LEN)) < 0)
 			{
-				fprintf(stderr, "error: unknown command from client: '%c...'\n", buffer[0]);
-				goto _end;
+				if(errno == EINTR)
+					continue;
+				fprintf(stderr, "error: failed to read from dev file: %s\n", strerror(errno));
+				return -1;
 			}
-			close(dev_file);	// common
-
-			{ /* remove this line from the buffer */
-				unsigned char *new_beg = newline+1;
-				unsigned cmd_len = new_beg - buffer;
-				unsigned remaining_size = buffer_len - cmd_len;
-				buffer = memmove(buffer, new_beg, remaining_size);
-				used_len -= cmd_len;
-				/* reduce buffer size */
-				new_beg = realloc(buffer, used_len);
-				if(!new_beg && used_len)
-				{
-					fprintf(stderr, "warning: failed to reduce buffer size: %s\n", strerror(errno));
-					// fortunately, the previous buffer is unchanged :)
-				}
-				else
+			if((sent = send(c->fd, c->out, r, MSG_NOSIGNAL)) < 0)
+			{
+				if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
 				{
-					buffer = new_beg;
-					buffer_len = used_len;
+					fprintf(stderr, "error: failed to send to client: %s\n", strerror(errno));
+					return -1;
 				}
+				sent = 0;
+			}
+			if(sent < r)
+			{
+				/* the rest is sent when the socket takes it */
+				c->out_pos = sent;
+				c->out_len = r;
+				return 0;
 			}
 		}
+		if(!r)
+			break;
 	}
+	/* EOF on file*/
+	client_dump_end(c);
+	return 1;
+}
 
-_end:
-	close(td->client_fd);
-	free(data);
-	if(buffer)
-		free(buffer);
-	return NULL;
+/*
+	Send what there is to send, as much as the socket takes, and once
+	a dump is all sent, go on with the commands after it
+*/
+static int client_flush(int epoll_fd, struct client *c)
+{
+	int r;
+	/* closed its end, it won't read the rest of a dump (and sendfile() can't be told not to raise SIGPIPE) */
+	if(c->eof && c->dump_fd >= 0)
+		client_dump_end(c);
+	while(1)
+	{
+		if(client_send(c))
+			return -1;
+		if(c->out_len)
+			break;
+		if(c->dump_fd >= 0)
+		{
+			if((r = client_dump(c)) < 0)
+				return -1;
+			if(!r)
+				break;
+		}
+		if(client_commands(c))
+			return -1;
+		if(c->dump_fd < 0)
+			break;
+	}
+	return client_watch(epoll_fd, c, EPOLL_CTL_MOD);
 }
 
-int main(int argc, char **argv)
+/*
+	Receive all there is (as much as there's room for), and run the
+	commands in it. With the buffer full of what's waiting on a dump,
+	it's left in the socket until then
+*/
+static int client_receive(int epoll_fd, struct client *c)
 {
-	int server_fd, client_fd;
-	struct sockaddr_in server_addr, client_addr;
-	int client_addr_len;
 	int r;
-	pthread_attr_t t_attr;
 
-	/* TODO setup handling of SIGTERM */
+	while(!c->eof)
+	{
+		/* make room */
+		if(c->end == line_len)
+		{
+			if(c->dump_fd >= 0)
+				break;
+			if(!c->start)
+			{
+				fprintf(stderr, "error: line from client longer than %u\n", line_len);
+				return -1;
+			}
+			memmove(c->buffer, c->buffer + c->start, c->end - c->start);
+			c->end -= c->start;
+			c->start = 0;
+		}
+
+		/* receive data */
+		if((r = recv(c->fd, c->buffer+c->end, line_len - c->end, 0)) < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				/* all of it, for now */
+				break;
+			}
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "error: failed to receive data from client: %s\n", strerror(errno));
+			return -1;
+		}
+		if(!r)
+		{
+			// EOF, what's still to send is sent before closing
+			fprintf(stderr, "debug: client disconnect\n");
+			c->eof = 1;
+			if(client_watch(epoll_fd, c, EPOLL_CTL_MOD))
+				return -1;
+			break;
+		}
+		c->end += r;
+
+		/* look for commands */
+		if(client_commands(c))
+			return -1;
+	}
+	client_touch(c);
+	return client_flush(epoll_fd, c);
+}
 
-	if((server_fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+static int server_accept(struct worker *w)
+{
+	struct sockaddr_in client_addr;
+	socklen_t client_addr_len;
+	struct client *c;
+	int client_fd;
+
+	while(1)
+	{
+		client_addr_len = sizeof(client_addr);
+		if((client_fd = accept4(w->server_fd, (struct sockaddr*)&client_addr, &client_addr_len, SOCK_NONBLOCK|SOCK_CLOEXEC)) < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf(stderr, "error: failed to accept client: %s\n", strerror(errno));
+			return -1;
+		}
+		if(!(c = calloc(1, sizeof(struct client))) || !(c->buffer = malloc(line_len)))
+		{
+			fprintf(stderr, "error: failed to allocate memory: %s\n", strerror(errno));
+			free(c);
+			close(client_fd);
+			continue;
+		}
+		c->w = w;
+		c->fd = client_fd;
+		c->dev_append = c->dump_fd = -1;
+		client_touch(c);
+		if(client_watch(w->epoll_fd, c, EPOLL_CTL_ADD))
+			client_close(c);
+	}
+}
+
+/* the worker's own listening socket, and its epoll */
+static int worker_listen(struct worker *w)
+{
+	struct sockaddr_in server_addr;
+
+	if((w->server_fd = socket(PF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, IPPROTO_TCP)) < 0)
 	{
 		fprintf(stderr, "error: failed to create socket: %s\n", strerror(errno));
 		return -1;
 	}
 
-	{ /* reuse address */
+	{ /* reuse address, and port, for the other workers */
 		int val = 1;
-		if(setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) < 0)
+		if(setsockopt(w->server_fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) < 0)
 		{
 			fprintf(stderr, "warning: failed to set REUSE_ADDR: %s\n", strerror(errno));
 		}
+		if(setsockopt(w->server_fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0)
+		{
+			fprintf(stderr, "error: failed to set REUSE_PORT: %s\n", strerror(errno));
+			goto _fail_1;
+		}
 	}
 
 	server_addr.sin_family = AF_INET;
 	server_addr.sin_port = htons(9000);
 	server_addr.sin_addr.s_addr = INADDR_ANY;
-	if(bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)))
+	if(bind(w->server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)))
 	{
 		fprintf(stderr, "error: failed to bind socket: %s\n", strerror(errno));
-		close(server_fd);
-		return -1;
+		goto _fail_1;
 	}
 
-	// thread attribute
-	if((r=pthread_attr_init(&t_attr)))
+	if(listen(w->server_fd, backlog))
 	{
-		fprintf(stderr, "error: failed to create thread attribute: %s\n", strerror(r));
-		close(server_fd);
-		return -1;
+		fprintf(stderr, "error: failed to listen on server: %s\n", strerror(errno));
+		goto _fail_1;
 	}
-	if((r=pthread_attr_setdetachstate(&t_attr, PTHREAD_CREATE_DETACHED)))
+
+	if((w->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
 	{
-		fprintf(stderr, "error: failed to set detached attribute: %s\n", strerror(r));
-		pthread_attr_destroy(&t_attr);
-		close(server_fd);
-		return -1;
+		fprintf(stderr, "error: failed to create epoll: %s\n", strerror(errno));
+		goto _fail_1;
 	}
+	{ /* the server has no client data */
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.ptr = NULL
+		};
+		if(epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->server_fd, &ev) < 0)
+		{
+			fprintf(stderr, "error: failed to watch server: %s\n", strerror(errno));
+			goto _fail_2;
+		}
+	}
+	return 0;
 
-	if(listen(server_fd, 1))
-	{
-		fprintf(stderr, "error: failed to listen on server: %s\n", strerror(errno));
-		pthread_attr_destroy(&t_attr);
-		close(server_fd);
-		return -1;
+_fail_2:
+	close(w->epoll_fd);
+_fail_1:
+	close(w->server_fd);
+	return -1;
+}
+
+static void * worker_runner(void *data)
+{
+	struct worker *w = (struct worker*)data;
+	struct epoll_event events[MAX_EVENTS];
+	struct client *c;
+	long long now;
+	int r, i, timeout;
+
+	{ /* a core each, if there's the affinity for it */
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(w->index % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+		if((r = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)))
+			fprintf(stderr, "warning: failed to pin worker %d: %s\n", w->index, strerror(r));
 	}
 
 	while(_run)
 	{
-		pthread_t client_thread;
-		struct thread_data *td;
-		client_addr_len = sizeof(client_addr);
-		if((client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_addr_len)) < 0)
+		/* until the next client times out, if any */
+		timeout = -1;
+		if(w->clients_head)
+		{
+			timeout = w->clients_head->last_ms + CLIENT_TIMEOUT_MS - now_ms();
+			if(timeout < 0)
+				timeout = 0;
+		}
+		if((r = epoll_wait(w->epoll_fd, events, MAX_EVENTS, timeout)) < 0)
 		{
 			if(errno == EINTR)
 				continue;
-			fprintf(stderr, "error: failed to accept client: %s\n", strerror(errno));
+			fprintf(stderr, "error: failed to wait for events: %s\n", strerror(errno));
+			w->failed = 1;
 			break;
 		}
-		if(!(td = (struct thread_data*)malloc(sizeof(struct thread_data))))
+		for(i=0;i<r;i++)
 		{
-			fprintf(stderr, "error: failed to allocate memory: %s\n", strerror(errno));
-			close(client_fd);
-			break;
+			if(!(c = events[i].data.ptr))
+			{
+				if(server_accept(w))
+				{
+					w->failed = 1;
+					goto _end;
+				}
+				continue;
+			}
+			/* closed while handling the ones before */
+			if(c->fd < 0)
+				continue;
+			if((events[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP)) && client_receive(w->epoll_fd, c))
+			{
+				client_close(c);
+				continue;
+			}
+			if(events[i].events & EPOLLOUT)
+			{
+				if(client_flush(w->epoll_fd, c))
+				{
+					client_close(c);
+					continue;
+				}
+				client_touch(c);
+			}
+			/* all said and sent */
+			if(c->eof && !c->out_len && c->dump_fd < 0)
+				client_close(c);
 		}
-		td->client_fd = client_fd;
-		if((r=pthread_create(&client_thread, &t_attr, thread_runner, (void*)td)))
+		/* the ones that had nothing to say */
+		now = now_ms();
+		while((c = w->clients_head) && now - c->last_ms >= CLIENT_TIMEOUT_MS)
+			client_close(c);
+		clients_free_closed(w);
+	}
+
+_end:
+	while(w->clients_head)
+		client_close(w->clients_head);
+	clients_free_closed(w);
+	close(w->epoll_fd);
+	close(w->server_fd);
+	return NULL;
+}
+
+/* parse a positive number option, at least `min` */
+static int arg_number(const char *name, unsigned *value, unsigned min)
+{
+	char *arg_end;
+	unsigned long number = strtoul(optarg, &arg_end, 10);
+	if(*arg_end || number < min || number > 0x7fffffff)
+	{
+		fprintf(stderr, "error: invalid %s: '%s'\n", name, optarg);
+		return -1;
+	}
+	*value = number;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers;
+	unsigned count = sysconf(_SC_NPROCESSORS_ONLN), started;
+	unsigned backlog_arg = BACKLOG;
+	int r, failed = 0;
+
+	while((r = getopt(argc, argv, "l:b:n:")) != -1)
+	{
+		switch(r)
+		{
+			case 'l':
+				/* at least a command, and its newline */
+				if(arg_number("line length", &line_len, 2))
+					return -1;
+				break;
+			case 'b':
+				if(arg_number("backlog", &backlog_arg, 1))
+					return -1;
+				backlog = backlog_arg;
+				break;
+			case 'n':
+				if(arg_number("number of workers", &count, 1))
+					return -1;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-l max line length] [-b backlog] [-n workers]\n", argv[0]);
+				return -1;
+		}
+	}
+	if(count < 1)
+		count = 1;
+
+	/* TODO setup handling of SIGTERM */
+
+	/* a client gone in the middle of a dump fails the send, it doesn't stop the server */
+	signal(SIGPIPE, SIG_IGN);
+
+	if(!(workers = calloc(count, sizeof(struct worker))))
+	{
+		fprintf(stderr, "error: failed to allocate memory: %s\n", strerror(errno));
+		return -1;
+	}
+	/* all of them listening before any accepts, so none gets it all */
+	for(started=0;started<count;started++)
+	{
+		workers[started].index = started;
+		if(worker_listen(&workers[started]))
+			goto _fail_1;
+	}
+	for(started=0;started<count;started++)
+	{
+		if((r = pthread_create(&workers[started].thread, NULL, worker_runner, &workers[started])))
 		{
 			fprintf(stderr, "error: failed to create thread: %s\n", strerror(r));
-			close(client_fd);
-			break;
+			goto _fail_2;
 		}
 	}
 
+	for(started=0;started<count;started++)
+	{
+		pthread_join(workers[started].thread, NULL);
+		failed |= workers[started].failed;
+	}
+
 	// alright, clean stuff
 	fprintf(stderr, "debug: cleaning\n");
+	free(workers);
 
-	pthread_attr_destroy(&t_attr);
-	close(server_fd);
+	/* if we had an unexpected exit from a worker, return is -1 */
+	return -failed;
 
-	/* if we had an unexpected exit from the loop, it was still running then return is -1 */
-	return -_run;
+_fail_2:
+	/* the ones running may be waiting for a while, they're cancelled (it's all closed on exit) */
+	_run = 0;
+	for(r=0;r<(int)started;r++)
+	{
+		pthread_cancel(workers[r].thread);
+		pthread_join(workers[r].thread, NULL);
+	}
+	for(;started<count;started++)
+	{
+		close(workers[started].epoll_fd);
+		close(workers[started].server_fd);
+	}
+	free(workers);
+	return -1;
+_fail_1:
+	while(started--)
+	{
+		close(workers[started].epoll_fd);
+		close(workers[started].server_fd);
+	}
+	free(workers);
+	return -1;
 }
@@ -0,0 +1,75 @@
+#!/bin/bash
+#
+# run the tNN fixtures against a ledserver (with its device), each on a
+# connection of its own, what it sends back is compared to tNN.out
+#
+# - tNN.in is sent at once, or tNN.in.1, tNN.in.2, ... as packets of
+#   their own (not cut at the lines), a moment apart
+# - tNN.other.1, tNN.other.2, ... are sent by another client, each
+#   right after the part with the same number, it closes after its last
+#
+# the client never closes its end, the server does it once it's been
+# idle for a second (or on an error), so all of the output is there
+
+set -e
+
+host=${1:-127.0.0.1}
+port=${2:-9000}
+
+cd `dirname $0`
+
+function send_part() {
+	cat $1 >&$2
+	sleep 0.2
+}
+
+received=`mktemp`
+failed=0
+for out in t*.out
+do
+	t=${out%.out}
+	exec 3<>/dev/tcp/$host/$port
+	if ls $t.other.* > /dev/null 2>&1
+	then
+		exec 4<>/dev/tcp/$host/$port
+	fi
+	if [ -f $t.in ]
+	then
+		send_part $t.in 3
+	fi
+	i=1
+	while [ -f $t.in.$i -o -f $t.other.$i ]
+	do
+		if [ -f $t.in.$i ]
+		then
+			send_part $t.in.$i 3
+		fi
+		if [ -f $t.other.$i ]
+		then
+			# read in first, so the close comes right after it's sent
+			IFS= read -r -d '' data < $t.other.$i || true
+			printf '%s' "$data" >&4
+			if [ ! -f $t.other.$((i + 1)) ]
+			then
+				exec 4>&-
+			fi
+			sleep 0.2
+		fi
+		i=$((i + 1))
+	done
+	# not closed after the idle second, that's a failure too (closed
+	# on an error, with the rest of the input unread, it's reset)
+	timeout 2 cat <&3 > $received 2>/dev/null && r=0 || r=$?
+	if [ $r -ne 124 ] && cmp -s $received $out
+	then
+		echo "$t: ok"
+	else
+		echo "$t: FAILED"
+		failed=1
+	fi
+	exec 3>&- 4>&-
+done
+
+rm -f $received
+test $failed -eq 0
+echo "All tests passed!"